@@ -0,0 +1,444 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "fpm_client.h"
+#include "../driver/fpmult.h"
+
+#define MAX_LIST	16
+#define POOL_PAIRS	4096
+
+struct bench_opts {
+	const char *path;
+	int use_sim;
+	struct fpm_sim sim;
+	enum fpm_method methods[MAX_LIST];
+	unsigned int n_methods;
+	unsigned int batches[MAX_LIST];
+	unsigned int n_batches;
+	unsigned int clients[MAX_LIST];
+	unsigned int n_clients;
+	unsigned long ops;
+	unsigned int warmup;
+	unsigned int prio;	/* class of the measured clients */
+	unsigned int bulk;	/* unmeasured FPM_PRIO_BULK clients loading the FPM meanwhile */
+	int json;
+};
+
+struct worker {
+	pthread_t thread;
+	const struct bench_opts *opts;
+	pthread_barrier_t *start;
+	enum fpm_method method;
+	unsigned int batch;
+	uint32_t *pool;
+	size_t pool_pairs;
+	uint32_t *res;
+	uint64_t *lat;
+	size_t n_lat;
+	unsigned long syscalls;
+	unsigned long mismatches;
+	uint64_t start_ns;
+	uint64_t end_ns;
+	int failed;
+};
+
+struct bulk_worker {
+	pthread_t thread;
+	const struct bench_opts *opts;
+	uint32_t *pool;
+	uint32_t *res;
+	int *stop;
+};
+
+struct bench_result {
+	enum fpm_method method;
+	unsigned int batch;
+	unsigned int clients;
+	unsigned int prio;
+	unsigned int bulk;
+	unsigned long ops;
+	double seconds;
+	double ops_per_sec;
+	double syscalls_per_op;
+	double p50_us;
+	double p99_us;
+	double p999_us;
+	unsigned long mismatches;
+};
+
+static void usage(const char *prog) {
+	printf("Usage: %s [options]\n", prog);
+	printf("  -d, --device PATH     device node (default %s)\n", FPM_DEV_PATH);
+	printf("  -s, --sim             use the in-process software stand-in\n");
+	printf("  -m, --methods LIST    submission methods (default text,binary,mmap)\n");
+	printf("  -b, --batch LIST      pairs per submission (default 1,5,64,1024)\n");
+	printf("  -c, --clients LIST    concurrent clients (default 1,2,4)\n");
+	printf("  -n, --ops N           multiplications per client (default 20000)\n");
+	printf("  -w, --warmup N        untimed batches per client (default 10)\n");
+	printf("  -p, --prio CLASS      high, normal or bulk for the measured clients (default normal)\n");
+	printf("      --bulk N          background bulk-class clients submitting %u-pair batches\n", POOL_PAIRS);
+	printf("  -f, --format FMT      csv or json (default csv)\n");
+	fpm_sim_usage();
+}
+
+static int parse_list(const char *arg, unsigned int *out, unsigned int *n) {
+	char *copy = strdup(arg);
+	char *save = NULL;
+	char *end;
+	*n = 0;
+	for(char *tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		if(*n == MAX_LIST) {
+			break;
+		}
+		out[*n] = strtoul(tok, &end, 0);
+		if(*end != '\0' || out[*n] == 0) {
+			free(copy);
+			return -1;
+		}
+		(*n)++;
+	}
+	free(copy);
+	return *n ? 0 : -1;
+}
+
+static int parse_methods(const char *arg, enum fpm_method *out, unsigned int *n) {
+	char *copy = strdup(arg);
+	char *save = NULL;
+	*n = 0;
+	for(char *tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		if(*n == MAX_LIST || fpm_method_parse(tok, &out[*n])) {
+			free(copy);
+			return -1;
+		}
+		(*n)++;
+	}
+	free(copy);
+	return *n ? 0 : -1;
+}
+
+/* Random operands in a range that neither overflows nor underflows */
+static void fill_pool(uint32_t *pool, size_t pairs, unsigned int seed) {
+	union { uint32_t u; float f; } v;
+	for(size_t i = 0; i < pairs * 2; i++) {
+		v.f = ((float)rand_r(&seed) / RAND_MAX - 0.5f) * 2000.0f;
+		pool[i] = v.u;
+	}
+}
+
+static void *worker_main(void *arg) {
+	struct worker *w = arg;
+	const struct bench_opts *o = w->opts;
+	struct fpm_conn conn;
+	unsigned long done = 0;
+	size_t off = 0;
+	unsigned int n;
+	uint64_t t0;
+	int ok;
+
+	ok = fpm_conn_open(&conn, o->path, w->method, o->use_sim ? &o->sim : NULL) == 0;
+	if(ok && o->prio != FPM_PRIO_NORMAL && fpm_conn_set_prio(&conn, o->prio)) {
+		perror("Setting priority failed");
+		fpm_conn_close(&conn);
+		ok = 0;
+	}
+	for(unsigned int i = 0; ok && i < o->warmup; i++) {
+		ok = fpm_conn_mul(&conn, w->pool, w->res, w->batch) == 0;
+	}
+	conn.syscalls = 0;
+	pthread_barrier_wait(w->start);
+	w->start_ns = fpm_now_ns();
+	if(!ok) {
+		w->failed = 1;
+		w->end_ns = w->start_ns;
+		return NULL;
+	}
+
+	while(done < o->ops) {
+		n = o->ops - done < w->batch ? o->ops - done : w->batch;
+		if(off + n > w->pool_pairs) {
+			off = 0;
+		}
+		t0 = fpm_now_ns();
+		if(fpm_conn_mul(&conn, w->pool + 2 * off, w->res, n)) {
+			w->failed = 1;
+			break;
+		}
+		w->lat[w->n_lat++] = fpm_now_ns() - t0;
+		for(unsigned int i = 0; i < n; i++) {
+			if(w->res[i] != fpm_soft_mul(w->pool[2 * (off + i)], w->pool[2 * (off + i) + 1])) {
+				w->mismatches++;
+			}
+		}
+		off += n;
+		done += n;
+	}
+	w->end_ns = fpm_now_ns();
+	w->syscalls = conn.syscalls;
+	fpm_conn_close(&conn);
+	return NULL;
+}
+
+static void *bulk_main(void *arg) {
+	struct bulk_worker *b = arg;
+	const struct bench_opts *o = b->opts;
+	struct fpm_conn conn;
+
+	if(fpm_conn_open(&conn, o->path, FPM_METHOD_BINARY, o->use_sim ? &o->sim : NULL)) {
+		return NULL;
+	}
+	if(fpm_conn_set_prio(&conn, FPM_PRIO_BULK) == 0) {
+		while(!__atomic_load_n(b->stop, __ATOMIC_RELAXED) &&
+		      fpm_conn_mul(&conn, b->pool, b->res, POOL_PAIRS) == 0);
+	}
+	fpm_conn_close(&conn);
+	return NULL;
+}
+
+static int run_one(const struct bench_opts *o, enum fpm_method method, unsigned int batch,
+		   unsigned int clients, struct bench_result *r) {
+	struct worker *w = calloc(clients, sizeof(struct worker));
+	pthread_barrier_t start;
+	size_t max_lat = (o->ops + batch - 1) / batch;
+	size_t n_lat = 0;
+	uint64_t *lat;
+	uint64_t t0 = UINT64_MAX;
+	uint64_t t1 = 0;
+	unsigned long syscalls = 0;
+	int failed = 0;
+	/* Batches larger than the default pool get a pool of their own size */
+	size_t pool_pairs = batch > POOL_PAIRS ? batch : POOL_PAIRS;
+	struct bulk_worker *bulk = calloc(o->bulk ? o->bulk : 1, sizeof(struct bulk_worker));
+	int stop = 0;
+
+	pthread_barrier_init(&start, NULL, clients + 1);
+	memset(r, 0, sizeof(*r));
+	for(unsigned int i = 0; i < o->bulk; i++) {
+		bulk[i].opts = o;
+		bulk[i].pool = calloc(POOL_PAIRS * 2, sizeof(uint32_t));
+		bulk[i].res = calloc(POOL_PAIRS, sizeof(uint32_t));
+		bulk[i].stop = &stop;
+		fill_pool(bulk[i].pool, POOL_PAIRS, 1000 + i);
+		pthread_create(&bulk[i].thread, NULL, bulk_main, &bulk[i]);
+	}
+	for(unsigned int i = 0; i < clients; i++) {
+		w[i].opts = o;
+		w[i].start = &start;
+		w[i].method = method;
+		w[i].batch = batch;
+		w[i].pool = calloc(pool_pairs * 2, sizeof(uint32_t));
+		w[i].pool_pairs = pool_pairs;
+		w[i].res = calloc(batch, sizeof(uint32_t));
+		w[i].lat = calloc(max_lat, sizeof(uint64_t));
+		fill_pool(w[i].pool, pool_pairs, i + 1);
+		pthread_create(&w[i].thread, NULL, worker_main, &w[i]);
+	}
+	pthread_barrier_wait(&start);
+	for(unsigned int i = 0; i < clients; i++) {
+		pthread_join(w[i].thread, NULL);
+		if(w[i].start_ns < t0) {
+			t0 = w[i].start_ns;
+		}
+		if(w[i].end_ns > t1) {
+			t1 = w[i].end_ns;
+		}
+		failed |= w[i].failed;
+		syscalls += w[i].syscalls;
+		r->mismatches += w[i].mismatches;
+		n_lat += w[i].n_lat;
+	}
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	for(unsigned int i = 0; i < o->bulk; i++) {
+		pthread_join(bulk[i].thread, NULL);
+		free(bulk[i].pool);
+		free(bulk[i].res);
+	}
+	free(bulk);
+
+	lat = malloc((n_lat ? n_lat : 1) * sizeof(uint64_t));
+	n_lat = 0;
+	for(unsigned int i = 0; i < clients; i++) {
+		memcpy(lat + n_lat, w[i].lat, w[i].n_lat * sizeof(uint64_t));
+		n_lat += w[i].n_lat;
+		free(w[i].pool);
+		free(w[i].res);
+		free(w[i].lat);
+	}
+	fpm_sort_samples(lat, n_lat);
+
+	r->method = method;
+	r->batch = batch;
+	r->clients = clients;
+	r->prio = o->prio;
+	r->bulk = o->bulk;
+	r->ops = o->ops * clients;
+	r->seconds = (t1 - t0) / 1e9;
+	r->ops_per_sec = r->seconds > 0 ? r->ops / r->seconds : 0;
+	r->syscalls_per_op = (double)syscalls / r->ops;
+	r->p50_us = fpm_percentile(lat, n_lat, 0.50) / 1e3;
+	r->p99_us = fpm_percentile(lat, n_lat, 0.99) / 1e3;
+	r->p999_us = fpm_percentile(lat, n_lat, 0.999) / 1e3;
+
+	free(lat);
+	free(w);
+	pthread_barrier_destroy(&start);
+	return failed ? -1 : 0;
+}
+
+static void print_result(const struct bench_opts *o, const struct bench_result *r, int first) {
+	if(o->json) {
+		printf("%s  {\"method\": \"%s\", \"batch\": %u, \"clients\": %u, \"prio\": \"%s\", "
+		       "\"bulk\": %u, \"ops\": %lu, "
+		       "\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"syscalls_per_op\": %.4f, "
+		       "\"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f, \"mismatches\": %lu}",
+		       first ? "" : ",\n", fpm_method_name(r->method), r->batch, r->clients,
+		       fpm_prio_name(r->prio), r->bulk, r->ops,
+		       r->seconds, r->ops_per_sec, r->syscalls_per_op,
+		       r->p50_us, r->p99_us, r->p999_us, r->mismatches);
+	}
+	else {
+		printf("%s,%u,%u,%s,%u,%lu,%.6f,%.1f,%.4f,%.3f,%.3f,%.3f,%lu\n",
+		       fpm_method_name(r->method), r->batch, r->clients,
+		       fpm_prio_name(r->prio), r->bulk, r->ops,
+		       r->seconds, r->ops_per_sec, r->syscalls_per_op,
+		       r->p50_us, r->p99_us, r->p999_us, r->mismatches);
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+	static const struct option long_opts[] = {
+		{ "device",	 required_argument, NULL, 'd' },
+		{ "sim",	 no_argument,	    NULL, 's' },
+		{ "methods",	 required_argument, NULL, 'm' },
+		{ "batch",	 required_argument, NULL, 'b' },
+		{ "clients",	 required_argument, NULL, 'c' },
+		{ "ops",	 required_argument, NULL, 'n' },
+		{ "warmup",	 required_argument, NULL, 'w' },
+		{ "prio",	 required_argument, NULL, 'p' },
+		{ "bulk",	 required_argument, NULL, 'B' },
+		{ "format",	 required_argument, NULL, 'f' },
+		{ "sim-call-ns", required_argument, NULL, 'C' },
+		{ "sim-pair-ns", required_argument, NULL, 'P' },
+		{ "sim-burst",	 required_argument, NULL, 'K' },
+		{ "help",	 no_argument,	    NULL, 'h' },
+		{ NULL, 0, NULL, 0 },
+	};
+	struct bench_opts o = {
+		.path = FPM_DEV_PATH,
+		.sim = FPM_SIM_DEFAULTS,
+		.methods = { FPM_METHOD_TEXT, FPM_METHOD_BINARY, FPM_METHOD_MMAP },
+		.n_methods = 3,
+		.batches = { 1, 5, 64, 1024 },
+		.n_batches = 4,
+		.clients = { 1, 2, 4 },
+		.n_clients = 3,
+		.ops = 20000,
+		.warmup = 10,
+		.prio = FPM_PRIO_NORMAL,
+	};
+	struct bench_result r;
+	int first = 1;
+	int failed = 0;
+	int opt;
+
+	while((opt = getopt_long(argc, argv, "d:sm:b:c:n:w:p:f:h", long_opts, NULL)) != -1) {
+		switch(opt) {
+			case 'd':
+				o.path = optarg;
+				break;
+			case 's':
+				o.use_sim = 1;
+				break;
+			case 'm':
+				if(parse_methods(optarg, o.methods, &o.n_methods)) {
+					fprintf(stderr, "Bad method list: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'b':
+				if(parse_list(optarg, o.batches, &o.n_batches)) {
+					fprintf(stderr, "Bad batch list: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'c':
+				if(parse_list(optarg, o.clients, &o.n_clients)) {
+					fprintf(stderr, "Bad client list: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'n':
+				o.ops = strtoul(optarg, NULL, 0);
+				break;
+			case 'w':
+				o.warmup = strtoul(optarg, NULL, 0);
+				break;
+			case 'p':
+				if(fpm_prio_parse(optarg, &o.prio)) {
+					fprintf(stderr, "Unknown priority class: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'B':
+				o.bulk = strtoul(optarg, NULL, 0);
+				break;
+			case 'f':
+				if(strcmp(optarg, "json") == 0) {
+					o.json = 1;
+				}
+				else if(strcmp(optarg, "csv") != 0) {
+					fprintf(stderr, "Unknown format: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'C':
+				o.sim.call_ns = strtoul(optarg, NULL, 0);
+				break;
+			case 'P':
+				o.sim.pair_ns = strtoul(optarg, NULL, 0);
+				break;
+			case 'K':
+				o.sim.burst_pairs = strtoul(optarg, NULL, 0);
+				break;
+			case 'h':
+				usage(argv[0]);
+				return 0;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if(o.ops == 0) {
+		fprintf(stderr, "Number of operations must be positive\n");
+		return 1;
+	}
+
+	if(o.json) {
+		printf("[\n");
+	}
+	else {
+		printf("method,batch,clients,prio,bulk,ops,seconds,ops_per_sec,syscalls_per_op,p50_us,p99_us,p999_us,mismatches\n");
+	}
+	for(unsigned int m = 0; m < o.n_methods; m++) {
+		for(unsigned int b = 0; b < o.n_batches; b++) {
+			for(unsigned int c = 0; c < o.n_clients; c++) {
+				if(run_one(&o, o.methods[m], o.batches[b], o.clients[c], &r)) {
+					fprintf(stderr, "%s batch %u clients %u failed\n",
+						fpm_method_name(o.methods[m]), o.batches[b], o.clients[c]);
+					failed = 1;
+					continue;
+				}
+				print_result(&o, &r, first);
+				first = 0;
+			}
+		}
+	}
+	if(o.json) {
+		printf("\n]\n");
+	}
+	return failed;
+}
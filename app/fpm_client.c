@@ -0,0 +1,386 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include "fpm_client.h"
+#include "../driver/fpmult.h"
+
+/* The stand-in has one FPM shared by every connection, arbitrated like the driver */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int busy;
+	unsigned int waiting[FPM_PRIO_LEVELS];
+} sim_sched = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static const char *method_names[] = {
+	[FPM_METHOD_TEXT]	= "text",
+	[FPM_METHOD_BINARY]	= "binary",
+	[FPM_METHOD_MMAP]	= "mmap",
+};
+
+static const char *prio_names[] = {
+	[FPM_PRIO_HIGH]		= "high",
+	[FPM_PRIO_NORMAL]	= "normal",
+	[FPM_PRIO_BULK]		= "bulk",
+};
+
+/* -------------------------------------- */
+/* ---------------HELPERS---------------- */
+/* -------------------------------------- */
+
+uint64_t fpm_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void fpm_sleep_until_ns(uint64_t t) {
+	struct timespec ts;
+	ts.tv_sec = t / 1000000000ull;
+	ts.tv_nsec = t % 1000000000ull;
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+/* Busy waits, sleeping would add scheduler latency to microsecond costs */
+static void spin_ns(uint64_t ns) {
+	uint64_t end = fpm_now_ns() + ns;
+	while(fpm_now_ns() < end);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+void fpm_sort_samples(uint64_t *samples, size_t n) {
+	qsort(samples, n, sizeof(uint64_t), cmp_u64);
+}
+
+uint64_t fpm_percentile(const uint64_t *sorted, size_t n, double q) {
+	size_t idx;
+	if(n == 0) {
+		return 0;
+	}
+	idx = (size_t)(q * n + 0.999999);
+	if(idx == 0) {
+		idx = 1;
+	}
+	if(idx > n) {
+		idx = n;
+	}
+	return sorted[idx - 1];
+}
+
+uint32_t fpm_soft_mul(uint32_t a, uint32_t b) {
+	union { uint32_t u; float f; } x, y, r;
+	x.u = a;
+	y.u = b;
+	r.f = x.f * y.f;
+	return r.u;
+}
+
+const char *fpm_method_name(enum fpm_method method) {
+	return method_names[method];
+}
+
+int fpm_method_parse(const char *name, enum fpm_method *method) {
+	for(unsigned int i = 0; i < sizeof(method_names) / sizeof(method_names[0]); i++) {
+		if(strcmp(name, method_names[i]) == 0) {
+			*method = i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+const char *fpm_prio_name(unsigned int prio) {
+	return prio_names[prio];
+}
+
+int fpm_prio_parse(const char *name, unsigned int *prio) {
+	for(unsigned int i = 0; i < FPM_PRIO_LEVELS; i++) {
+		if(strcmp(name, prio_names[i]) == 0) {
+			*prio = i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* Help for the --sim-* options every tool takes */
+void fpm_sim_usage(void) {
+	printf("      --sim-call-ns N   stand-in cost of a system call (default %u)\n", FPM_SIM_CALL_NS);
+	printf("      --sim-pair-ns N   stand-in cost of a multiplication (default %u)\n", FPM_SIM_PAIR_NS);
+	printf("      --sim-burst N     stand-in pairs per FPM burst, 0 for whole batches (default %u)\n", FPM_BURST_PAIRS);
+}
+
+uint32_t *fpm_conn_staging_ops(struct fpm_conn *c) {
+	return c->staging + FPM_STAGING_OPS_OFF / sizeof(uint32_t);
+}
+
+uint32_t *fpm_conn_staging_res(struct fpm_conn *c) {
+	return c->staging + FPM_STAGING_RES_OFF / sizeof(uint32_t);
+}
+
+/* -------------------------------------- */
+/* ------------OPEN AND CLOSE------------ */
+/* -------------------------------------- */
+
+int fpm_conn_open(struct fpm_conn *c, const char *path, enum fpm_method method, const struct fpm_sim *sim) {
+	memset(c, 0, sizeof(*c));
+	c->prio = FPM_PRIO_NORMAL;
+	c->method = method;
+	c->sim = sim;
+	c->fd = -1;
+	if(sim) {
+		if(method != FPM_METHOD_TEXT) {
+			c->staging = calloc(1, FPM_STAGING_SIZE);
+			if(!c->staging) {
+				return -1;
+			}
+		}
+		return 0;
+	}
+	c->fd = open(path, O_RDWR);
+	if(c->fd < 0) {
+		fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if(method == FPM_METHOD_MMAP) {
+		c->staging = mmap(NULL, FPM_STAGING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd,
+				  FPM_STAGING_PGOFF * sysconf(_SC_PAGESIZE));
+		if(c->staging == MAP_FAILED) {
+			fprintf(stderr, "Can't map staging area of %s: %s\n", path, strerror(errno));
+			c->staging = NULL;
+			close(c->fd);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void fpm_conn_close(struct fpm_conn *c) {
+	if(c->sim) {
+		free(c->staging);
+	}
+	else {
+		if(c->staging) {
+			munmap(c->staging, FPM_STAGING_SIZE);
+		}
+		close(c->fd);
+	}
+	c->staging = NULL;
+	c->fd = -1;
+}
+
+int fpm_conn_set_prio(struct fpm_conn *c, unsigned int prio) {
+	__u32 val = prio;
+	if(!c->sim && ioctl(c->fd, FPM_IOC_SET_PRIO, &val) < 0) {
+		return -1;
+	}
+	c->prio = prio;
+	return 0;
+}
+
+/* -------------------------------------- */
+/* ------------SOFTWARE MODEL------------ */
+/* -------------------------------------- */
+
+static void sim_acquire(unsigned int prio) {
+	unsigned int p;
+	pthread_mutex_lock(&sim_sched.lock);
+	/* Same rule as the driver, a new claim also yields to waiters of its own class */
+	for(p = 0; p <= prio && !sim_sched.waiting[p]; p++);
+	if(sim_sched.busy || p <= prio) {
+		sim_sched.waiting[prio]++;
+		for(;;) {
+			for(p = 0; p < prio && !sim_sched.waiting[p]; p++);
+			if(!sim_sched.busy && p == prio) {
+				break;
+			}
+			pthread_cond_wait(&sim_sched.cond, &sim_sched.lock);
+		}
+		sim_sched.waiting[prio]--;
+	}
+	sim_sched.busy = 1;
+	pthread_mutex_unlock(&sim_sched.lock);
+}
+
+static void sim_release(void) {
+	pthread_mutex_lock(&sim_sched.lock);
+	sim_sched.busy = 0;
+	pthread_cond_broadcast(&sim_sched.cond);
+	pthread_mutex_unlock(&sim_sched.lock);
+}
+
+static void sim_call(struct fpm_conn *c) {
+	c->syscalls++;
+	spin_ns(c->sim->call_ns);
+}
+
+static void sim_run(struct fpm_conn *c, const uint32_t *ops, uint32_t *res, unsigned int count) {
+	unsigned int burst = c->sim->burst_pairs ? c->sim->burst_pairs : count;
+	unsigned int n;
+	for(unsigned int done = 0; done < count; done += n) {
+		n = count - done < burst ? count - done : burst;
+		sim_acquire(c->prio);
+		for(unsigned int i = done; i < done + n; i++) {
+			res[i] = fpm_soft_mul(ops[2 * i], ops[2 * i + 1]);
+		}
+		spin_ns((uint64_t)c->sim->pair_ns * n);
+		sim_release();
+	}
+}
+
+/* Parses the text the same way fpm_write does */
+static unsigned int sim_text_write(const char *buff, uint32_t *ops) {
+	char str1[51];
+	char str2[51];
+	unsigned int n = 0;
+	int pomeraj = 0;
+	while(n < FPM_TEXT_PAIRS && sscanf(buff + pomeraj, "%50[^,], %50[^;];", str1, str2) == 2) {
+		sscanf(str1, "%x", &ops[2 * n]);
+		sscanf(str2, "%x", &ops[2 * n + 1]);
+		pomeraj += strlen(str1) + strlen(str2) + 3;
+		n++;
+	}
+	return n;
+}
+
+/* -------------------------------------- */
+/* -------------SUBMISSION--------------- */
+/* -------------------------------------- */
+
+static int text_chunk(struct fpm_conn *c, const uint32_t *ops, uint32_t *res, unsigned int count) {
+	char buff[FPM_TEXT_PAIRS * 24 + 1];
+	char line[256];
+	uint32_t sim_ops[FPM_TEXT_PAIRS * 2];
+	uint32_t sim_res[FPM_TEXT_PAIRS];
+	unsigned int idx;
+	unsigned int n;
+	uint32_t val;
+	int len = 0;
+	ssize_t ret;
+
+	for(unsigned int i = 0; i < count; i++) {
+		len += snprintf(buff + len, sizeof(buff) - len, "%#x, %#x;", ops[2 * i], ops[2 * i + 1]);
+	}
+	if(c->sim) {
+		sim_call(c);
+		n = sim_text_write(buff, sim_ops);
+		sim_run(c, sim_ops, sim_res, n);
+		for(unsigned int i = 0; i < n; i++) {
+			sim_call(c);
+			snprintf(line, sizeof(line), "		RES %d: %#x\n", i + 1, sim_res[i]);
+			if(sscanf(line, " RES %u: %x", &idx, &val) == 2) {
+				res[idx - 1] = val;
+			}
+		}
+		sim_call(c);
+		return 0;
+	}
+	c->syscalls++;
+	if(write(c->fd, buff, len) != len) {
+		return -1;
+	}
+	for(;;) {
+		c->syscalls++;
+		ret = read(c->fd, line, sizeof(line) - 1);
+		if(ret == 0) {
+			break;
+		}
+		if(ret < 0) {
+			return -1;
+		}
+		line[ret] = '\0';
+		if(sscanf(line, " RES %u: %x", &idx, &val) == 2 && idx >= 1 && idx <= count) {
+			res[idx - 1] = val;
+		}
+	}
+	return 0;
+}
+
+static int staging_chunk(struct fpm_conn *c, const uint32_t *ops, uint32_t *res, unsigned int count) {
+	struct fpm_batch batch = { .count = count, .flags = FPM_BATCH_STAGING };
+	uint32_t *staging_ops = fpm_conn_staging_ops(c);
+	uint32_t *staging_res = fpm_conn_staging_res(c);
+
+	if(ops != staging_ops) {
+		memcpy(staging_ops, ops, count * 2 * sizeof(uint32_t));
+	}
+	if(c->sim) {
+		sim_call(c);
+		sim_run(c, staging_ops, staging_res, count);
+	}
+	else {
+		c->syscalls++;
+		if(ioctl(c->fd, FPM_IOC_MUL, &batch) < 0) {
+			return -1;
+		}
+	}
+	if(res != staging_res) {
+		memcpy(res, staging_res, count * sizeof(uint32_t));
+	}
+	return 0;
+}
+
+static int binary_mul(struct fpm_conn *c, const uint32_t *ops, uint32_t *res, unsigned int count) {
+	struct fpm_batch batch = {
+		.count = count,
+		.ops = (uintptr_t)ops,
+		.res = (uintptr_t)res,
+	};
+	unsigned int done = 0;
+	unsigned int chunk;
+
+	if(!c->sim) {
+		c->syscalls++;
+		return ioctl(c->fd, FPM_IOC_MUL, &batch) < 0 ? -1 : 0;
+	}
+	/* The driver bounces through the staging area in FPM_STAGING_PAIRS chunks */
+	sim_call(c);
+	while(done < count) {
+		chunk = count - done < FPM_STAGING_PAIRS ? count - done : FPM_STAGING_PAIRS;
+		memcpy(fpm_conn_staging_ops(c), ops + 2 * done, chunk * 2 * sizeof(uint32_t));
+		sim_run(c, fpm_conn_staging_ops(c), fpm_conn_staging_res(c), chunk);
+		memcpy(res + done, fpm_conn_staging_res(c), chunk * sizeof(uint32_t));
+		done += chunk;
+	}
+	return 0;
+}
+
+int fpm_conn_mul(struct fpm_conn *c, const uint32_t *ops, uint32_t *res, unsigned int count) {
+	unsigned int done = 0;
+	unsigned int chunk;
+	unsigned int max;
+
+	if(c->method == FPM_METHOD_BINARY) {
+		return binary_mul(c, ops, res, count);
+	}
+	max = c->method == FPM_METHOD_TEXT ? FPM_TEXT_PAIRS : FPM_STAGING_PAIRS;
+	while(done < count) {
+		chunk = count - done < max ? count - done : max;
+		if(c->method == FPM_METHOD_TEXT) {
+			if(text_chunk(c, ops + 2 * done, res + done, chunk)) {
+				return -1;
+			}
+		}
+		else if(staging_chunk(c, ops + 2 * done, res + done, chunk)) {
+			return -1;
+		}
+		done += chunk;
+	}
+	return 0;
+}
@@ -0,0 +1,63 @@
+#ifndef FPM_CLIENT_H
+#define FPM_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FPM_DEV_PATH		"/dev/fpmult"
+/* Pairs the driver's text interface accepts in one write */
+#define FPM_TEXT_PAIRS		5
+
+enum fpm_method {
+	FPM_METHOD_TEXT,	/* "0x.., 0x..;" strings through write/read */
+	FPM_METHOD_BINARY,	/* FPM_IOC_MUL with user pointers */
+	FPM_METHOD_MMAP,	/* FPM_IOC_MUL on the mmap'ed staging area */
+};
+
+/* Cost model of the in-process stand-in for the driver and the FPM */
+struct fpm_sim {
+	unsigned int call_ns;	/* cost of one system call */
+	unsigned int pair_ns;	/* cost of one multiplication (three DMA transfers) */
+	unsigned int burst_pairs;	/* pairs per FPM burst, as the driver's burst_pairs */
+};
+
+#define FPM_SIM_CALL_NS		300
+#define FPM_SIM_PAIR_NS		2000
+/* Needs ../driver/fpmult.h, the bursts follow the driver's default */
+#define FPM_SIM_DEFAULTS	{ .call_ns = FPM_SIM_CALL_NS, .pair_ns = FPM_SIM_PAIR_NS, .burst_pairs = FPM_BURST_PAIRS }
+
+struct fpm_conn {
+	enum fpm_method method;
+	int fd;
+	const struct fpm_sim *sim;	/* NULL when talking to the device */
+	uint32_t *staging;		/* staging area, mapped or simulated */
+	unsigned int prio;		/* FPM_PRIO_* */
+	unsigned long syscalls;		/* system calls issued (or modelled) so far */
+};
+
+int  fpm_conn_open(struct fpm_conn *c, const char *path, enum fpm_method method, const struct fpm_sim *sim);
+void fpm_conn_close(struct fpm_conn *c);
+int  fpm_conn_set_prio(struct fpm_conn *c, unsigned int prio);
+/*
+ * Multiplies count pairs ops[2i] * ops[2i + 1] into res[i].
+ * With FPM_METHOD_MMAP, ops and res may point into the staging area
+ * (count <= FPM_STAGING_PAIRS) to skip the copies.
+ */
+int  fpm_conn_mul(struct fpm_conn *c, const uint32_t *ops, uint32_t *res, unsigned int count);
+uint32_t *fpm_conn_staging_ops(struct fpm_conn *c);
+uint32_t *fpm_conn_staging_res(struct fpm_conn *c);
+
+const char *fpm_method_name(enum fpm_method method);
+int  fpm_method_parse(const char *name, enum fpm_method *method);
+const char *fpm_prio_name(unsigned int prio);
+int  fpm_prio_parse(const char *name, unsigned int *prio);
+void fpm_sim_usage(void);
+
+uint32_t fpm_soft_mul(uint32_t a, uint32_t b);
+uint64_t fpm_now_ns(void);
+void fpm_sleep_until_ns(uint64_t t);
+void fpm_sort_samples(uint64_t *samples, size_t n);
+/* q quantile (0 < q <= 1) of n sorted samples */
+uint64_t fpm_percentile(const uint64_t *sorted, size_t n, double q);
+
+#endif
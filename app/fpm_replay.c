@@ -0,0 +1,399 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "fpm_client.h"
+#include "../driver/fpmult.h"
+
+/*
+ * Replays a request trace captured from debugfs fpmult/trace. Every traced
+ * client gets a thread that submits its requests open loop at the recorded
+ * times, scaled by the speed factor, so latency is measured from when a
+ * request was due and includes any time spent behind schedule.
+ *
+ *   echo 1 > /sys/kernel/debug/fpmult/trace_enable
+ *   cat /sys/kernel/debug/fpmult/trace > trace.bin &
+ *   ... run the workload ...
+ *   echo 0 > /sys/kernel/debug/fpmult/trace_enable
+ */
+
+struct request {
+	uint64_t at_ns;		/* offset from the earliest request in the trace */
+	enum fpm_method method;
+	unsigned int count;
+	uint32_t *ops;
+};
+
+struct replay;
+
+struct client {
+	pthread_t thread;
+	struct replay *rp;
+	uint32_t id;
+	unsigned int prio;
+	struct request *reqs;
+	size_t n_reqs;
+	size_t cap_reqs;
+	/* Filled in by the replay */
+	uint64_t *lat;
+	uint64_t *lag;
+	unsigned long mismatches;
+	uint64_t end_ns;
+	int failed;
+};
+
+struct replay {
+	const char *path;
+	const struct fpm_sim *sim;
+	int force_method;	/* -1 replays the recorded method */
+	double speed;		/* 0 submits without pacing */
+	struct client *clients;
+	unsigned int n_clients;
+	pthread_barrier_t start;
+	uint64_t t0;
+};
+
+static void usage(const char *prog) {
+	printf("Usage: %s [options] TRACE\n", prog);
+	printf("  -d, --device PATH     device node (default %s)\n", FPM_DEV_PATH);
+	printf("  -s, --sim             use the in-process software stand-in\n");
+	printf("  -x, --speed F         replay F times faster than recorded, 0 for no pacing (default 1)\n");
+	printf("  -m, --method NAME     submit everything as text, binary or mmap instead of as recorded\n");
+	fpm_sim_usage();
+}
+
+/* -------------------------------------- */
+/* -------------TRACE LOADING------------ */
+/* -------------------------------------- */
+
+static enum fpm_method trace_method(uint8_t method) {
+	switch(method) {
+		case FPM_TRACE_TEXT:
+			return FPM_METHOD_TEXT;
+		case FPM_TRACE_STAGING:
+			return FPM_METHOD_MMAP;
+		default:
+			/* Streams go through their staging area like an ioctl batch */
+			return FPM_METHOD_BINARY;
+	}
+}
+
+static struct client *client_get(struct replay *rp, const struct fpm_trace_rec *rec) {
+	for(unsigned int i = 0; i < rp->n_clients; i++) {
+		if(rp->clients[i].id == rec->client) {
+			return &rp->clients[i];
+		}
+	}
+	rp->clients = realloc(rp->clients, (rp->n_clients + 1) * sizeof(struct client));
+	memset(&rp->clients[rp->n_clients], 0, sizeof(struct client));
+	rp->clients[rp->n_clients].id = rec->client;
+	rp->clients[rp->n_clients].prio = rec->prio < FPM_PRIO_LEVELS ? rec->prio : FPM_PRIO_NORMAL;
+	return &rp->clients[rp->n_clients++];
+}
+
+/* Stable insertion sort by at_ns, the requests are nearly in order already */
+static void client_sort(struct client *c) {
+	struct request tmp;
+	size_t j;
+	for(size_t i = 1; i < c->n_reqs; i++) {
+		tmp = c->reqs[i];
+		for(j = i; j > 0 && c->reqs[j - 1].at_ns > tmp.at_ns; j--) {
+			c->reqs[j] = c->reqs[j - 1];
+		}
+		c->reqs[j] = tmp;
+	}
+}
+
+static int trace_load(struct replay *rp, FILE *f) {
+	struct fpm_trace_rec rec;
+	struct request *req;
+	struct client *c;
+	uint64_t first = UINT64_MAX;
+	unsigned long lost = 0;
+	size_t n_recs = 0;
+
+	while(fread(&rec, sizeof(rec), 1, f) == 1) {
+		n_recs++;
+		lost += rec.lost;
+		c = client_get(rp, &rec);
+		if((rec.flags & FPM_TRACE_CONT) && c->n_reqs) {
+			/* Rest of a batch larger than the staging area */
+			req = &c->reqs[c->n_reqs - 1];
+			req->ops = realloc(req->ops, (size_t)(req->count + rec.count) * 2 * sizeof(uint32_t));
+		}
+		else {
+			if(c->n_reqs == c->cap_reqs) {
+				c->cap_reqs = c->cap_reqs ? c->cap_reqs * 2 : 64;
+				c->reqs = realloc(c->reqs, c->cap_reqs * sizeof(struct request));
+			}
+			req = &c->reqs[c->n_reqs++];
+			/* Made relative once the earliest request is known */
+			req->at_ns = rec.ts_ns;
+			if(rec.ts_ns < first) {
+				first = rec.ts_ns;
+			}
+			req->method = trace_method(rec.method);
+			req->count = 0;
+			req->ops = malloc((size_t)rec.count * 2 * sizeof(uint32_t));
+		}
+		if(!req->ops) {
+			fprintf(stderr, "Out of memory\n");
+			return -1;
+		}
+		if(fread(req->ops + 2 * req->count, 2 * sizeof(uint32_t), rec.count, f) != rec.count) {
+			fprintf(stderr, "Trace is truncated\n");
+			return -1;
+		}
+		req->count += rec.count;
+	}
+	if(!n_recs) {
+		fprintf(stderr, "Trace is empty\n");
+		return -1;
+	}
+	for(unsigned int i = 0; i < rp->n_clients; i++) {
+		c = &rp->clients[i];
+		for(size_t j = 0; j < c->n_reqs; j++) {
+			c->reqs[j].at_ns -= first;
+		}
+		client_sort(c);
+	}
+	if(lost) {
+		fprintf(stderr, "Trace lost %lu records while capturing, the buffer was full\n", lost);
+	}
+	return 0;
+}
+
+/* -------------------------------------- */
+/* ---------------REPLAY----------------- */
+/* -------------------------------------- */
+
+static void *client_main(void *arg) {
+	struct client *c = arg;
+	struct replay *rp = c->rp;
+	struct fpm_conn conns[3];
+	int opened[3] = { 0 };
+	uint32_t *res;
+	unsigned int max = 0;
+	uint64_t due;
+	uint64_t t;
+
+	for(size_t i = 0; i < c->n_reqs; i++) {
+		if(c->reqs[i].count > max) {
+			max = c->reqs[i].count;
+		}
+		if(rp->force_method >= 0) {
+			c->reqs[i].method = rp->force_method;
+		}
+	}
+	res = malloc((max ? max : 1) * sizeof(uint32_t));
+	/* Connections are opened up front so the replay itself only submits */
+	for(size_t i = 0; res && i < c->n_reqs; i++) {
+		enum fpm_method m = c->reqs[i].method;
+		if(opened[m]) {
+			continue;
+		}
+		if(fpm_conn_open(&conns[m], rp->path, m, rp->sim)) {
+			c->failed = 1;
+			break;
+		}
+		opened[m] = 1;
+		if(c->prio != FPM_PRIO_NORMAL && fpm_conn_set_prio(&conns[m], c->prio)) {
+			fprintf(stderr, "Client %u: can't set %s priority: %s\n", c->id, fpm_prio_name(c->prio), strerror(errno));
+		}
+	}
+	pthread_barrier_wait(&rp->start);
+
+	for(size_t i = 0; res && !c->failed && i < c->n_reqs; i++) {
+		struct request *req = &c->reqs[i];
+		due = rp->t0 + (rp->speed > 0 ? (uint64_t)(req->at_ns / rp->speed) : 0);
+		fpm_sleep_until_ns(due);
+		t = fpm_now_ns();
+		if(!rp->speed) {
+			due = t;
+		}
+		c->lag[i] = t > due ? t - due : 0;
+		if(fpm_conn_mul(&conns[req->method], req->ops, res, req->count)) {
+			fprintf(stderr, "Client %u: submission failed: %s\n", c->id, strerror(errno));
+			c->failed = 1;
+			break;
+		}
+		c->lat[i] = fpm_now_ns() - due;
+		for(unsigned int j = 0; j < req->count; j++) {
+			if(res[j] != fpm_soft_mul(req->ops[2 * j], req->ops[2 * j + 1])) {
+				c->mismatches++;
+			}
+		}
+	}
+	c->end_ns = fpm_now_ns();
+	for(int m = 0; m < 3; m++) {
+		if(opened[m]) {
+			fpm_conn_close(&conns[m]);
+		}
+	}
+	if(!res) {
+		c->failed = 1;
+	}
+	free(res);
+	return NULL;
+}
+
+/* -------------------------------------- */
+/* -----------------MAIN----------------- */
+/* -------------------------------------- */
+
+int main(int argc, char **argv) {
+	static const struct option long_opts[] = {
+		{ "device",	required_argument, NULL, 'd' },
+		{ "sim",	no_argument,	   NULL, 's' },
+		{ "speed",	required_argument, NULL, 'x' },
+		{ "method",	required_argument, NULL, 'm' },
+		{ "sim-call-ns", required_argument, NULL, 'C' },
+		{ "sim-pair-ns", required_argument, NULL, 'P' },
+		{ "sim-burst",	required_argument, NULL, 'K' },
+		{ "help",	no_argument,	   NULL, 'h' },
+		{ NULL, 0, NULL, 0 },
+	};
+	struct fpm_sim sim = FPM_SIM_DEFAULTS;
+	struct replay rp = {
+		.path = FPM_DEV_PATH,
+		.force_method = -1,
+		.speed = 1.0,
+	};
+	enum fpm_method method;
+	uint64_t *lat, *lag;
+	size_t n_reqs = 0;
+	size_t n = 0;
+	uint64_t pairs = 0;
+	uint64_t t1 = 0;
+	unsigned long mismatches = 0;
+	int failed = 0;
+	double secs;
+	FILE *f;
+	int opt;
+
+	while((opt = getopt_long(argc, argv, "d:sx:m:h", long_opts, NULL)) != -1) {
+		switch(opt) {
+			case 'd':
+				rp.path = optarg;
+				break;
+			case 's':
+				rp.sim = &sim;
+				break;
+			case 'x':
+				rp.speed = strtod(optarg, NULL);
+				break;
+			case 'm':
+				if(fpm_method_parse(optarg, &method)) {
+					fprintf(stderr, "Unknown method: %s\n", optarg);
+					return 1;
+				}
+				rp.force_method = method;
+				break;
+			case 'C':
+				sim.call_ns = strtoul(optarg, NULL, 0);
+				break;
+			case 'P':
+				sim.pair_ns = strtoul(optarg, NULL, 0);
+				break;
+			case 'K':
+				sim.burst_pairs = strtoul(optarg, NULL, 0);
+				break;
+			case 'h':
+				usage(argv[0]);
+				return 0;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if(argc - optind != 1 || rp.speed < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	f = fopen(argv[optind], "rb");
+	if(!f) {
+		fprintf(stderr, "Can't open %s: %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+	if(trace_load(&rp, f)) {
+		fclose(f);
+		return 1;
+	}
+	fclose(f);
+
+	for(unsigned int i = 0; i < rp.n_clients; i++) {
+		struct client *c = &rp.clients[i];
+		c->lat = calloc(c->n_reqs, sizeof(uint64_t));
+		c->lag = calloc(c->n_reqs, sizeof(uint64_t));
+		n_reqs += c->n_reqs;
+		for(size_t j = 0; j < c->n_reqs; j++) {
+			pairs += c->reqs[j].count;
+		}
+	}
+
+	pthread_barrier_init(&rp.start, NULL, rp.n_clients + 1);
+	for(unsigned int i = 0; i < rp.n_clients; i++) {
+		rp.clients[i].rp = &rp;
+		pthread_create(&rp.clients[i].thread, NULL, client_main, &rp.clients[i]);
+	}
+	rp.t0 = fpm_now_ns() + 1000000;
+	pthread_barrier_wait(&rp.start);
+	for(unsigned int i = 0; i < rp.n_clients; i++) {
+		pthread_join(rp.clients[i].thread, NULL);
+	}
+
+	lat = malloc(n_reqs * sizeof(uint64_t));
+	lag = malloc(n_reqs * sizeof(uint64_t));
+	for(unsigned int i = 0; i < rp.n_clients; i++) {
+		struct client *c = &rp.clients[i];
+		memcpy(lat + n, c->lat, c->n_reqs * sizeof(uint64_t));
+		memcpy(lag + n, c->lag, c->n_reqs * sizeof(uint64_t));
+		n += c->n_reqs;
+		failed |= c->failed;
+		mismatches += c->mismatches;
+		if(c->end_ns > t1) {
+			t1 = c->end_ns;
+		}
+	}
+	fpm_sort_samples(lat, n);
+	fpm_sort_samples(lag, n);
+
+	secs = t1 > rp.t0 ? (t1 - rp.t0) / 1e9 : 0;
+	printf("%zu requests, %llu pairs from %u clients in %.3f s", n_reqs, (unsigned long long)pairs, rp.n_clients, secs);
+	if(rp.speed > 0) {
+		printf(" at %gx\n", rp.speed);
+	}
+	else {
+		printf(" unpaced\n");
+	}
+	printf("throughput: %.1f pairs/s, %.1f requests/s\n",
+	       secs > 0 ? pairs / secs : 0, secs > 0 ? n_reqs / secs : 0);
+	printf("latency us: p50 %.3f p99 %.3f p999 %.3f\n",
+	       fpm_percentile(lat, n, 0.50) / 1e3, fpm_percentile(lat, n, 0.99) / 1e3,
+	       fpm_percentile(lat, n, 0.999) / 1e3);
+	printf("start lag us: p50 %.3f p99 %.3f\n",
+	       fpm_percentile(lag, n, 0.50) / 1e3, fpm_percentile(lag, n, 0.99) / 1e3);
+	if(mismatches) {
+		printf("mismatches: %lu\n", mismatches);
+	}
+
+	free(lat);
+	free(lag);
+	for(unsigned int i = 0; i < rp.n_clients; i++) {
+		for(size_t j = 0; j < rp.clients[i].n_reqs; j++) {
+			free(rp.clients[i].reqs[j].ops);
+		}
+		free(rp.clients[i].reqs);
+		free(rp.clients[i].lat);
+		free(rp.clients[i].lag);
+	}
+	free(rp.clients);
+	pthread_barrier_destroy(&rp.start);
+	return failed || mismatches ? 1 : 0;
+}
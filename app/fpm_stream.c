@@ -0,0 +1,367 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "fpm_client.h"
+#include "../driver/fpmult.h"
+
+/*
+ * Multiplies two binary float32 files element by element into a third.
+ * Reading, device submission and writing run in their own threads and
+ * hand chunks to each other through a ring of buffers, so while one chunk
+ * is on the device the next is being read and the previous one written.
+ */
+
+enum slot_state {
+	SLOT_FREE,
+	SLOT_READ,
+	SLOT_DONE,
+};
+
+struct slot {
+	enum slot_state state;
+	unsigned int count;	/* pairs in this chunk, 0 marks the end of input */
+	uint32_t *ops;
+	uint32_t *res;
+};
+
+struct stream {
+	const char *path;
+	enum fpm_method method;
+	const struct fpm_sim *sim;
+	int fd_a;
+	int fd_b;
+	int fd_out;
+	uint64_t total;		/* pairs to process */
+	unsigned int chunk;	/* pairs per slot */
+	unsigned int n_slots;
+	struct slot *slots;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int failed;
+	uint64_t busy_ns[3];	/* time each stage spent working */
+};
+
+enum { STAGE_READ, STAGE_DEVICE, STAGE_WRITE };
+
+static void usage(const char *prog) {
+	printf("Usage: %s [options] A.bin B.bin OUT.bin\n", prog);
+	printf("  -d, --device PATH     device node (default %s)\n", FPM_DEV_PATH);
+	printf("  -s, --sim             use the in-process software stand-in\n");
+	printf("  -m, --method NAME     binary or mmap (default mmap)\n");
+	printf("  -k, --chunk N         pairs per chunk (default %u)\n", FPM_STAGING_PAIRS);
+	printf("  -q, --buffers N       chunks in flight, at least 2 (default 4)\n");
+	fpm_sim_usage();
+}
+
+/* -------------------------------------- */
+/* ------------SLOT HANDOFF-------------- */
+/* -------------------------------------- */
+
+static struct slot *slot_wait(struct stream *st, unsigned int idx, enum slot_state state) {
+	struct slot *s = &st->slots[idx % st->n_slots];
+	pthread_mutex_lock(&st->lock);
+	while(s->state != state && !st->failed) {
+		pthread_cond_wait(&st->cond, &st->lock);
+	}
+	pthread_mutex_unlock(&st->lock);
+	return st->failed ? NULL : s;
+}
+
+static void slot_pass(struct stream *st, struct slot *s, enum slot_state state) {
+	pthread_mutex_lock(&st->lock);
+	s->state = state;
+	pthread_cond_broadcast(&st->cond);
+	pthread_mutex_unlock(&st->lock);
+}
+
+static void stream_fail(struct stream *st) {
+	pthread_mutex_lock(&st->lock);
+	st->failed = 1;
+	pthread_cond_broadcast(&st->cond);
+	pthread_mutex_unlock(&st->lock);
+}
+
+static int read_full(int fd, void *buf, size_t len, off_t off) {
+	ssize_t ret;
+	size_t done = 0;
+	while(done < len) {
+		ret = pread(fd, (char *)buf + done, len - done, off + done);
+		if(ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if(ret <= 0) {
+			return -1;
+		}
+		done += ret;
+	}
+	return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+	ssize_t ret;
+	size_t done = 0;
+	while(done < len) {
+		ret = write(fd, (const char *)buf + done, len - done);
+		if(ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if(ret <= 0) {
+			return -1;
+		}
+		done += ret;
+	}
+	return 0;
+}
+
+/* -------------------------------------- */
+/* ---------------STAGES----------------- */
+/* -------------------------------------- */
+
+static void *reader_main(void *arg) {
+	struct stream *st = arg;
+	uint32_t *a = malloc(st->chunk * sizeof(uint32_t));
+	uint32_t *b = malloc(st->chunk * sizeof(uint32_t));
+	uint64_t done = 0;
+	unsigned int count;
+	struct slot *s;
+	uint64_t t0;
+
+	for(unsigned int idx = 0; ; idx++) {
+		s = slot_wait(st, idx, SLOT_FREE);
+		if(!s) {
+			break;
+		}
+		t0 = fpm_now_ns();
+		count = st->total - done < st->chunk ? st->total - done : st->chunk;
+		if(count) {
+			if(read_full(st->fd_a, a, count * sizeof(uint32_t), done * sizeof(uint32_t)) ||
+			   read_full(st->fd_b, b, count * sizeof(uint32_t), done * sizeof(uint32_t))) {
+				fprintf(stderr, "Reading input failed: %s\n", strerror(errno));
+				stream_fail(st);
+				break;
+			}
+			for(unsigned int i = 0; i < count; i++) {
+				s->ops[2 * i] = a[i];
+				s->ops[2 * i + 1] = b[i];
+			}
+		}
+		st->busy_ns[STAGE_READ] += fpm_now_ns() - t0;
+		done += count;
+		s->count = count;
+		/* The slot belongs to the next stage once passed on */
+		slot_pass(st, s, SLOT_READ);
+		if(!count) {
+			break;
+		}
+	}
+	free(a);
+	free(b);
+	return NULL;
+}
+
+static void *device_main(void *arg) {
+	struct stream *st = arg;
+	struct fpm_conn conn;
+	unsigned int count;
+	struct slot *s;
+	uint64_t t0;
+
+	if(fpm_conn_open(&conn, st->path, st->method, st->sim)) {
+		stream_fail(st);
+		return NULL;
+	}
+	for(unsigned int idx = 0; ; idx++) {
+		s = slot_wait(st, idx, SLOT_READ);
+		if(!s) {
+			break;
+		}
+		t0 = fpm_now_ns();
+		count = s->count;
+		if(count && fpm_conn_mul(&conn, s->ops, s->res, count)) {
+			fprintf(stderr, "Device submission failed: %s\n", strerror(errno));
+			stream_fail(st);
+			break;
+		}
+		st->busy_ns[STAGE_DEVICE] += fpm_now_ns() - t0;
+		slot_pass(st, s, SLOT_DONE);
+		if(!count) {
+			break;
+		}
+	}
+	fpm_conn_close(&conn);
+	return NULL;
+}
+
+static void *writer_main(void *arg) {
+	struct stream *st = arg;
+	struct slot *s;
+	uint64_t t0;
+
+	for(unsigned int idx = 0; ; idx++) {
+		s = slot_wait(st, idx, SLOT_DONE);
+		if(!s || !s->count) {
+			break;
+		}
+		t0 = fpm_now_ns();
+		if(write_full(st->fd_out, s->res, s->count * sizeof(uint32_t))) {
+			fprintf(stderr, "Writing output failed: %s\n", strerror(errno));
+			stream_fail(st);
+			break;
+		}
+		st->busy_ns[STAGE_WRITE] += fpm_now_ns() - t0;
+		slot_pass(st, s, SLOT_FREE);
+	}
+	return NULL;
+}
+
+/* -------------------------------------- */
+/* -----------------MAIN----------------- */
+/* -------------------------------------- */
+
+static uint64_t file_elems(int fd, const char *name) {
+	struct stat sb;
+	if(fstat(fd, &sb)) {
+		return 0;
+	}
+	if(sb.st_size % sizeof(uint32_t)) {
+		fprintf(stderr, "%s: ignoring %ld trailing bytes\n", name, (long)(sb.st_size % sizeof(uint32_t)));
+	}
+	return sb.st_size / sizeof(uint32_t);
+}
+
+int main(int argc, char **argv) {
+	static const struct option long_opts[] = {
+		{ "device",	required_argument, NULL, 'd' },
+		{ "sim",	no_argument,	   NULL, 's' },
+		{ "method",	required_argument, NULL, 'm' },
+		{ "chunk",	required_argument, NULL, 'k' },
+		{ "buffers",	required_argument, NULL, 'q' },
+		{ "sim-call-ns", required_argument, NULL, 'C' },
+		{ "sim-pair-ns", required_argument, NULL, 'P' },
+		{ "sim-burst",	required_argument, NULL, 'K' },
+		{ "help",	no_argument,	   NULL, 'h' },
+		{ NULL, 0, NULL, 0 },
+	};
+	struct fpm_sim sim = FPM_SIM_DEFAULTS;
+	struct stream st = {
+		.path = FPM_DEV_PATH,
+		.method = FPM_METHOD_MMAP,
+		.chunk = FPM_STAGING_PAIRS,
+		.n_slots = 4,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	pthread_t threads[3];
+	uint64_t n_a, n_b;
+	uint64_t t0, t1;
+	double secs;
+	int opt;
+
+	while((opt = getopt_long(argc, argv, "d:sm:k:q:h", long_opts, NULL)) != -1) {
+		switch(opt) {
+			case 'd':
+				st.path = optarg;
+				break;
+			case 's':
+				st.sim = &sim;
+				break;
+			case 'm':
+				if(fpm_method_parse(optarg, &st.method) || st.method == FPM_METHOD_TEXT) {
+					fprintf(stderr, "Method must be binary or mmap\n");
+					return 1;
+				}
+				break;
+			case 'k':
+				st.chunk = strtoul(optarg, NULL, 0);
+				break;
+			case 'q':
+				st.n_slots = strtoul(optarg, NULL, 0);
+				break;
+			case 'C':
+				sim.call_ns = strtoul(optarg, NULL, 0);
+				break;
+			case 'P':
+				sim.pair_ns = strtoul(optarg, NULL, 0);
+				break;
+			case 'K':
+				sim.burst_pairs = strtoul(optarg, NULL, 0);
+				break;
+			case 'h':
+				usage(argv[0]);
+				return 0;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if(argc - optind != 3 || st.chunk == 0 || st.n_slots < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	st.fd_a = open(argv[optind], O_RDONLY);
+	st.fd_b = open(argv[optind + 1], O_RDONLY);
+	st.fd_out = open(argv[optind + 2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(st.fd_a < 0 || st.fd_b < 0 || st.fd_out < 0) {
+		fprintf(stderr, "Can't open files: %s\n", strerror(errno));
+		return 1;
+	}
+	posix_fadvise(st.fd_a, 0, 0, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(st.fd_b, 0, 0, POSIX_FADV_SEQUENTIAL);
+	n_a = file_elems(st.fd_a, argv[optind]);
+	n_b = file_elems(st.fd_b, argv[optind + 1]);
+	if(n_a != n_b) {
+		fprintf(stderr, "Inputs differ in length, using the first %llu elements\n",
+			(unsigned long long)(n_a < n_b ? n_a : n_b));
+	}
+	st.total = n_a < n_b ? n_a : n_b;
+
+	st.slots = calloc(st.n_slots, sizeof(struct slot));
+	for(unsigned int i = 0; i < st.n_slots; i++) {
+		st.slots[i].ops = malloc(st.chunk * 2 * sizeof(uint32_t));
+		st.slots[i].res = malloc(st.chunk * sizeof(uint32_t));
+		if(!st.slots[i].ops || !st.slots[i].res) {
+			fprintf(stderr, "Out of memory\n");
+			return 1;
+		}
+	}
+
+	t0 = fpm_now_ns();
+	pthread_create(&threads[STAGE_READ], NULL, reader_main, &st);
+	pthread_create(&threads[STAGE_DEVICE], NULL, device_main, &st);
+	pthread_create(&threads[STAGE_WRITE], NULL, writer_main, &st);
+	for(int i = 0; i < 3; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	t1 = fpm_now_ns();
+
+	for(unsigned int i = 0; i < st.n_slots; i++) {
+		free(st.slots[i].ops);
+		free(st.slots[i].res);
+	}
+	free(st.slots);
+	close(st.fd_a);
+	close(st.fd_b);
+	if(close(st.fd_out)) {
+		st.failed = 1;
+	}
+	if(st.failed) {
+		return 1;
+	}
+
+	secs = (t1 - t0) / 1e9;
+	fprintf(stderr, "%llu pairs in %.3f s: %.1f pairs/s, %.2f MB/s in\n",
+		(unsigned long long)st.total, secs, secs > 0 ? st.total / secs : 0,
+		secs > 0 ? st.total * 8 / secs / 1e6 : 0);
+	fprintf(stderr, "busy: read %.3f s, device %.3f s, write %.3f s\n",
+		st.busy_ns[STAGE_READ] / 1e9, st.busy_ns[STAGE_DEVICE] / 1e9, st.busy_ns[STAGE_WRITE] / 1e9);
+	return 0;
+}
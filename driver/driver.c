@@ -20,6 +20,22 @@
 #include <linux/of.h>
 #include <linux/dma-mapping.h>  
 #include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
+#include <linux/uio.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/bitmap.h>
+#include <linux/wait.h>
+#include <linux/sched/signal.h>
+#include <linux/capability.h>
+#include <linux/debugfs.h>
+#include <linux/kfifo.h>
+#include <linux/poll.h>
+
+#include "fpmult.h"
 
 MODULE_AUTHOR("Kosana Mina Matija");
 MODULE_DESCRIPTION("FPM IP core driver");
@@ -28,13 +44,38 @@ MODULE_LICENSE("Dual BSD/GPL");
 #define DRIVER_NAME 	"fpm_driver" 
 #define BUFF_SIZE 	200
 #define NIZ_SIZE 	5
+/* NIZ_SIZE pairs of "%50[^,], %50[^;];" */
+#define WRITE_BUFF_SIZE	(NIZ_SIZE * 103 + 1)
+#define CACHE_MAX_ENTRIES	(1 << 20)
+#define BURST_MAX_PAIRS		FPM_STAGING_PAIRS
 
-int endRead = 0;
-int cnt = 0;
-int cnt_in = 0;
-int pos_in = 0;
-int pos_out = 0;
-int counter_out = 0;
+static bool emulate;
+module_param(emulate, bool, S_IRUGO);
+MODULE_PARM_DESC(emulate, "Bind to software emulated FPM and AXI DMA devices instead of the FPGA");
+static unsigned int emu_setup_ns = 1000;
+module_param(emu_setup_ns, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(emu_setup_ns, "Emulated fixed cost of one DMA transfer, in ns");
+static unsigned int emu_beat_ns = 10;
+module_param(emu_beat_ns, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(emu_beat_ns, "Emulated cost of one 32-bit stream beat, in ns");
+static unsigned int emu_bw_mbps = 0;
+module_param(emu_bw_mbps, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(emu_bw_mbps, "Emulated memory bandwidth of one DMA channel in MB/s, 0 for unlimited");
+static unsigned int emu_fault_every = 0;
+module_param(emu_fault_every, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(emu_fault_every, "Fail every Nth emulated DMA transfer with a slave error, 0 for never");
+static unsigned int emu_hang_every = 0;
+module_param(emu_hang_every, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(emu_hang_every, "Never complete every Nth emulated DMA transfer, 0 for never");
+static unsigned int dma_timeout_us = 1000;
+module_param(dma_timeout_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(dma_timeout_us, "Time one DMA transfer may take before the channels are reset, in us");
+static unsigned int dma_retries = 2;
+module_param(dma_retries, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(dma_retries, "Times a failed multiplication is retried after a reset before it fails with an error");
+static unsigned int trace_buf_kb = 1024;
+module_param(trace_buf_kb, uint, S_IRUGO);
+MODULE_PARM_DESC(trace_buf_kb, "Size of the request trace buffer in KiB, allocated when tracing is first enabled");
 
 /* -------------------------------------- */
 /* --------FPM IP RELATED MACROS--------- */
@@ -65,18 +106,43 @@ int counter_out = 0;
 #define IOC_IRQ_EN				1<<12
 #define ERR_IRQ_EN				1<<14
 
+#define DMASR_HALTED				(1<<0)
+#define DMASR_IDLE				(1<<1)
+#define DMASR_DMA_INT_ERR			(1<<4)
+#define DMASR_DMA_SLV_ERR			(1<<5)
+#define DMASR_DMA_DEC_ERR			(1<<6)
+#define DMASR_IOC_IRQ				(1<<12)
+#define DMASR_ERR_IRQ				(1<<14)
+#define DMASR_IRQ_MASK				0x00007000
+#define DMA_RESET_TIMEOUT_US			100
+
+/* -------------------------------------- */
+/* -------EMULATED BACKEND MACROS-------- */
+/* -------------------------------------- */
+
+#define EMU_REG_SPACE				0x60
+#define EMU_FIFO_DEPTH				16
+
 
 /* -------------------------------------- */
 /* --------FUNCTION DECLARATIONS--------- */
 /* -------------------------------------- */
 
+struct fpm_info;
+struct fpm_client;
+struct fpm_emu_chan;
+
 static int  fpm_probe(struct platform_device *pdev);
 static int  fpm_remove(struct platform_device *pdev);
 int         fpm_open(struct inode *pinode, struct file *pfile);
 int         fpm_close(struct inode *pinode, struct file *pfile);
-ssize_t     fpm_read(struct file *pfile, char __user *buffer, size_t length, loff_t *offset);
-ssize_t     fpm_write(struct file *pfile, const char __user *buffer, size_t length, loff_t *offset);
+static ssize_t fpm_text_read(struct fpm_client *client, struct iov_iter *to);
+static ssize_t fpm_text_write(struct fpm_client *client, struct iov_iter *from);
+static ssize_t fpm_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t fpm_write_iter(struct kiocb *iocb, struct iov_iter *from);
+static __poll_t fpm_poll(struct file *f, poll_table *wait);
 static int  fpm_mmap(struct file *f, struct vm_area_struct *vma_s);
+static long fpm_ioctl(struct file *pfile, unsigned int cmd, unsigned long arg);
 
 static int  __init fpm_init(void);
 static void __exit fpm_exit(void);
@@ -85,12 +151,28 @@ static irqreturn_t dma0_MM2S_isr(int irq, void* dev_id);
 static irqreturn_t dma1_MM2S_isr(int irq, void* dev_id);
 static irqreturn_t dma2_S2MM_isr(int irq, void* dev_id);
 
-int dma_init0(void __iomem *base_address);
-int dma_init1(void __iomem *base_address);
-int dma_init2(void __iomem *base_address);
-unsigned int dma_simple_write1(dma_addr_t TxBufferPtr, unsigned int pkt_len, void __iomem *base_address); 
-unsigned int dma_simple_write2(dma_addr_t TxBufferPtr, unsigned int pkt_len, void __iomem *base_address); 
-unsigned int dma_simple_read(dma_addr_t TxBufferPtr, unsigned int pkt_len, void __iomem *base_address);
+int dma_init0(struct fpm_info *dev);
+int dma_init1(struct fpm_info *dev);
+int dma_init2(struct fpm_info *dev);
+int dma_simple_write1(dma_addr_t TxBufferPtr, unsigned int pkt_len, struct fpm_info *dev); 
+int dma_simple_write2(dma_addr_t TxBufferPtr, unsigned int pkt_len, struct fpm_info *dev); 
+int dma_simple_read(dma_addr_t TxBufferPtr, unsigned int pkt_len, struct fpm_info *dev);
+static int  fpm_mul_pair(dma_addr_t a_phy, dma_addr_t b_phy, dma_addr_t res_phy);
+static int  fpm_mul_tx(u32 a, u32 b, u32 *res);
+static int  fpm_mul_batch(struct fpm_client *client, struct fpm_batch *batch);
+static int  fpm_mul_staging(struct fpm_client *client, unsigned int first, unsigned int count);
+static int  fpm_dma_recover(int err);
+
+static u32  fpm_ioread32(struct fpm_info *dev, u32 reg);
+static void fpm_iowrite32(struct fpm_info *dev, u32 val, u32 reg);
+
+static int  fpm_emu_register(void);
+static void fpm_emu_unregister(void);
+static int  fpm_emu_probe(struct platform_device *pdev);
+static int  fpm_emu_remove(struct platform_device *pdev);
+static u32  fpm_emu_read(struct fpm_emu_chan *ch, u32 reg);
+static void fpm_emu_write(struct fpm_emu_chan *ch, u32 reg, u32 val);
+static void fpm_emu_sync(struct fpm_emu_chan *ch);
 
 /* -------------------------------------- */
 /* -----------GLOBAL VARIABLES----------- */
@@ -101,6 +183,71 @@ struct fpm_info {
 	unsigned long mem_end;
 	void __iomem *base_addr;
 	int irq_num;
+	struct fpm_emu_chan *emu;	/* NULL for the FPGA */
+};
+
+/* Per open file state */
+struct fpm_client {
+	struct mutex lock;
+	u32 *staging_vir;
+	dma_addr_t staging_phy;
+	/* Kernel only copy of the staging area the result cache works from */
+	u32 *shadow_vir;
+	dma_addr_t shadow_phy;
+	/* Binary stream (write_iter/read_iter, splice, sendfile) through the staging area */
+	unsigned int in_bytes;		/* operand bytes written */
+	unsigned int in_done;		/* pairs already multiplied */
+	unsigned int out_bytes;		/* result bytes read back */
+	DECLARE_BITMAP(cache_hit, FPM_STAGING_PAIRS);
+	unsigned int prio;		/* FPM_PRIO_* */
+	u32 id;				/* client id in the request trace */
+	/* Text protocol (read/write) */
+	u32 ulazni_niz[NIZ_SIZE * 2];
+	u32 izlazni_niz[NIZ_SIZE];
+	int pos_in;
+	int cnt_in;
+	int pos_out;
+	int counter_out;
+	int cnt;
+	int endRead;
+	bool stream;			/* FPM_MODE_STREAM selected */
+	bool stream_end;		/* FPM_IOC_STREAM_END, no more operands */
+	wait_queue_head_t stream_wait;	/* readers waiting for results, writers for room */
+};
+
+/* Arbitration of the FPM between clients, a higher class waiting blocks lower ones */
+struct fpm_sched {
+	spinlock_t lock;
+	wait_queue_head_t wait;
+	bool busy;
+	unsigned int waiting[FPM_PRIO_LEVELS];
+};
+
+struct fpm_cache_entry {
+	u64 key;
+	u32 val;
+	u32 valid;
+};
+
+/* Direct mapped cache of products, keyed on the operand pair */
+struct fpm_cache {
+	spinlock_t lock;
+	struct fpm_cache_entry *entries;	/* NULL while disabled */
+	unsigned int bits;
+	u64 hits;
+	u64 misses;
+};
+
+/* Ring of struct fpm_trace_rec, each followed by its operand pairs */
+struct fpm_trace {
+	spinlock_t lock;		/* serializes writers */
+	struct mutex read_lock;		/* serializes readers and the allocation */
+	struct kfifo fifo;		/* allocated when first enabled */
+	bool enabled;
+	u32 lost;			/* records dropped since the last one stored */
+	unsigned int reserved;		/* ring bytes promised to batches in progress */
+	wait_queue_head_t wait;
+	struct dentry *dir;
 };
 
 dev_t my_dev_id;
@@ -115,9 +262,13 @@ struct file_operations my_fops = {
 	.owner 		= THIS_MODULE,
 	.open 		= fpm_open,
 	.release 	= fpm_close,
-	.read 		= fpm_read,
-	.write 		= fpm_write,
-	.mmap		= fpm_mmap
+	.mmap		= fpm_mmap,
+	.unlocked_ioctl	= fpm_ioctl,
+	.read_iter	= fpm_read_iter,
+	.write_iter	= fpm_write_iter,
+	.poll		= fpm_poll,
+	.splice_read	= generic_file_splice_read,
+	.splice_write	= iter_file_splice_write
 };
 
 static struct of_device_id fpm_of_match[] = {
@@ -145,8 +296,401 @@ int device_fsm = 0;
 volatile int transaction_over0 = 0;
 volatile int transaction_over1 = 0;
 volatile int transaction_over2 = 0;
-u32 izlazni_niz[NIZ_SIZE];
-u32 ulazni_niz[NIZ_SIZE * 2];
+/* DMASR of a transfer that ended with an error interrupt, 0 on success */
+volatile u32 transaction_err0 = 0;
+volatile u32 transaction_err1 = 0;
+volatile u32 transaction_err2 = 0;
+static unsigned long dma_errors;
+static unsigned long dma_timeouts;
+/* DMA channels are shared by all clients, only one burst owns them at a time */
+static struct fpm_sched fpm_sched = {
+	.lock = __SPIN_LOCK_UNLOCKED(fpm_sched.lock),
+	.wait = __WAIT_QUEUE_HEAD_INITIALIZER(fpm_sched.wait),
+};
+static unsigned int burst_pairs = FPM_BURST_PAIRS;
+static struct fpm_cache fpm_cache = {
+	.lock = __SPIN_LOCK_UNLOCKED(fpm_cache.lock),
+};
+static struct fpm_trace fpm_trace = {
+	.lock = __SPIN_LOCK_UNLOCKED(fpm_trace.lock),
+	.read_lock = __MUTEX_INITIALIZER(fpm_trace.read_lock),
+	.wait = __WAIT_QUEUE_HEAD_INITIALIZER(fpm_trace.wait),
+};
+static atomic_t fpm_client_ids = ATOMIC_INIT(0);
+
+/* -------------------------------------- */
+/* -------------SCHEDULER---------------- */
+/* -------------------------------------- */
+
+/*
+ * A queued client only defers to higher classes. A new claim, which is also
+ * how a client comes back at a burst boundary, defers to its own class too,
+ * so a client cannot hold on to the FPM across bursts while others wait.
+ */
+static bool fpm_sched_claim(unsigned int prio, bool queued) {
+	unsigned int limit = queued ? prio : prio + 1;
+	bool ok;
+	spin_lock(&fpm_sched.lock);
+	ok = !fpm_sched.busy;
+	for(unsigned int p = 0; ok && p < limit; p++) {
+		if(fpm_sched.waiting[p]) {
+			ok = false;
+		}
+	}
+	if(ok) {
+		fpm_sched.busy = true;
+		if(queued) {
+			fpm_sched.waiting[prio]--;
+		}
+	}
+	spin_unlock(&fpm_sched.lock);
+	return ok;
+}
+
+/* Waits until the FPM is free and no higher class is waiting for it, -EINTR when killed */
+static int fpm_sched_acquire(unsigned int prio) {
+	if(fpm_sched_claim(prio, false)) {
+		return 0;
+	}
+	spin_lock(&fpm_sched.lock);
+	fpm_sched.waiting[prio]++;
+	spin_unlock(&fpm_sched.lock);
+	if(wait_event_killable(fpm_sched.wait, fpm_sched_claim(prio, true))) {
+		spin_lock(&fpm_sched.lock);
+		fpm_sched.waiting[prio]--;
+		spin_unlock(&fpm_sched.lock);
+		/* Lower classes may have been held back only by this waiter */
+		wake_up_all(&fpm_sched.wait);
+		return -EINTR;
+	}
+	return 0;
+}
+
+static void fpm_sched_release(void) {
+	spin_lock(&fpm_sched.lock);
+	fpm_sched.busy = false;
+	spin_unlock(&fpm_sched.lock);
+	wake_up_all(&fpm_sched.wait);
+}
+
+/* -------------------------------------- */
+/* -------------RESULT CACHE------------- */
+/* -------------------------------------- */
+
+/* a * b == b * a, both orders share one entry */
+static u64 fpm_cache_key(u32 a, u32 b) {
+	return a < b ? ((u64)a << 32) | b : ((u64)b << 32) | a;
+}
+
+/*
+ * Looks up pairs first..first+count-1 of ops, filling res and the hit bitmap.
+ * Returns false when the cache is disabled, otherwise *misses is set.
+ */
+static bool fpm_cache_lookup(const u32 *ops, u32 *res, unsigned int first, unsigned int count,
+			     unsigned long *hit, unsigned int *misses) {
+	struct fpm_cache_entry *e;
+	u64 key;
+	if(!READ_ONCE(fpm_cache.entries)) {
+		return false;
+	}
+	spin_lock(&fpm_cache.lock);
+	if(!fpm_cache.entries) {
+		spin_unlock(&fpm_cache.lock);
+		return false;
+	}
+	*misses = 0;
+	for(unsigned int i = first; i < first + count; i++) {
+		key = fpm_cache_key(ops[2 * i], ops[2 * i + 1]);
+		e = &fpm_cache.entries[hash_64(key, fpm_cache.bits)];
+		if(e->valid && e->key == key) {
+			res[i] = e->val;
+			__set_bit(i, hit);
+		}
+		else {
+			__clear_bit(i, hit);
+			(*misses)++;
+		}
+	}
+	fpm_cache.hits += count - *misses;
+	fpm_cache.misses += *misses;
+	spin_unlock(&fpm_cache.lock);
+	return true;
+}
+
+/* Stores the products of the pairs that missed, ops and res must be kernel memory nobody else can write */
+static void fpm_cache_fill(const u32 *ops, const u32 *res, unsigned int first, unsigned int count,
+			   const unsigned long *hit) {
+	struct fpm_cache_entry *e;
+	u64 key;
+	spin_lock(&fpm_cache.lock);
+	if(!fpm_cache.entries) {
+		spin_unlock(&fpm_cache.lock);
+		return;
+	}
+	for(unsigned int i = first; i < first + count; i++) {
+		if(test_bit(i, hit)) {
+			continue;
+		}
+		key = fpm_cache_key(ops[2 * i], ops[2 * i + 1]);
+		e = &fpm_cache.entries[hash_64(key, fpm_cache.bits)];
+		e->key = key;
+		e->val = res[i];
+		e->valid = 1;
+	}
+	spin_unlock(&fpm_cache.lock);
+}
+
+/* Replaces the table, 0 entries disables the cache */
+static int fpm_cache_resize(unsigned int entries) {
+	struct fpm_cache_entry *table = NULL;
+	struct fpm_cache_entry *old;
+	unsigned int bits = 0;
+	if(entries > CACHE_MAX_ENTRIES) {
+		return -EINVAL;
+	}
+	if(entries) {
+		/* hash_64 needs at least one bit */
+		bits = max_t(unsigned int, order_base_2(entries), 1);
+		table = kvcalloc(1 << bits, sizeof(struct fpm_cache_entry), GFP_KERNEL);
+		if(!table) {
+			return -ENOMEM;
+		}
+	}
+	spin_lock(&fpm_cache.lock);
+	old = fpm_cache.entries;
+	WRITE_ONCE(fpm_cache.entries, table);
+	fpm_cache.bits = bits;
+	fpm_cache.hits = 0;
+	fpm_cache.misses = 0;
+	spin_unlock(&fpm_cache.lock);
+	kvfree(old);
+	printk(KERN_INFO "[fpm_cache] Result cache set to %u entries\n", table ? 1 << bits : 0);
+	return 0;
+}
+
+static ssize_t cache_size_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	unsigned int entries;
+	spin_lock(&fpm_cache.lock);
+	entries = fpm_cache.entries ? 1 << fpm_cache.bits : 0;
+	spin_unlock(&fpm_cache.lock);
+	return sprintf(buf, "%u\n", entries);
+}
+
+static ssize_t cache_size_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	unsigned int entries;
+	int ret;
+	ret = kstrtouint(buf, 0, &entries);
+	if(ret) {
+		return ret;
+	}
+	ret = fpm_cache_resize(entries);
+	if(ret) {
+		return ret;
+	}
+	return count;
+}
+
+static ssize_t cache_hits_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	u64 hits;
+	spin_lock(&fpm_cache.lock);
+	hits = fpm_cache.hits;
+	spin_unlock(&fpm_cache.lock);
+	return sprintf(buf, "%llu\n", hits);
+}
+
+static ssize_t cache_misses_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	u64 misses;
+	spin_lock(&fpm_cache.lock);
+	misses = fpm_cache.misses;
+	spin_unlock(&fpm_cache.lock);
+	return sprintf(buf, "%llu\n", misses);
+}
+
+static ssize_t burst_pairs_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	return sprintf(buf, "%u\n", READ_ONCE(burst_pairs));
+}
+
+static ssize_t burst_pairs_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	unsigned int pairs;
+	int ret;
+	ret = kstrtouint(buf, 0, &pairs);
+	if(ret) {
+		return ret;
+	}
+	if(pairs == 0 || pairs > BURST_MAX_PAIRS) {
+		return -EINVAL;
+	}
+	WRITE_ONCE(burst_pairs, pairs);
+	return count;
+}
+
+static ssize_t dma_errors_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	return sprintf(buf, "%lu\n", READ_ONCE(dma_errors));
+}
+
+static ssize_t dma_timeouts_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	return sprintf(buf, "%lu\n", READ_ONCE(dma_timeouts));
+}
+
+static DEVICE_ATTR_RW(cache_size);
+static DEVICE_ATTR_RO(cache_hits);
+static DEVICE_ATTR_RO(cache_misses);
+static DEVICE_ATTR_RW(burst_pairs);
+static DEVICE_ATTR_RO(dma_errors);
+static DEVICE_ATTR_RO(dma_timeouts);
+
+static struct attribute *fpm_attrs[] = {
+	&dev_attr_cache_size.attr,
+	&dev_attr_cache_hits.attr,
+	&dev_attr_cache_misses.attr,
+	&dev_attr_burst_pairs.attr,
+	&dev_attr_dma_errors.attr,
+	&dev_attr_dma_timeouts.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(fpm);
+
+/* -------------------------------------- */
+/* ------------REQUEST TRACE------------- */
+/* -------------------------------------- */
+
+/*
+ * Submissions are recorded into a ring of trace_buf_kb while tracing is
+ * on. Reading debugfs fpmult/trace drains it and blocks while tracing is
+ * on and the ring is empty, so "cat trace > file" captures until tracing
+ * is switched off. When the ring is full records are dropped and counted
+ * in the next stored one. A batch split over several records reserves the
+ * room for all of them first, so it is recorded whole or not at all.
+ */
+
+/* Reserves bytes of the ring for records records, false if they are dropped */
+static bool fpm_trace_reserve(u64 bytes, unsigned int records) {
+	bool ok;
+	if(!smp_load_acquire(&fpm_trace.enabled)) {
+		return false;
+	}
+	spin_lock(&fpm_trace.lock);
+	ok = kfifo_avail(&fpm_trace.fifo) >= fpm_trace.reserved + bytes;
+	if(ok) {
+		fpm_trace.reserved += bytes;
+	}
+	else {
+		fpm_trace.lost += records;
+	}
+	spin_unlock(&fpm_trace.lock);
+	return ok;
+}
+
+/* Gives back what is left of a reservation */
+static void fpm_trace_unreserve(unsigned int bytes) {
+	if(!bytes) {
+		return;
+	}
+	spin_lock(&fpm_trace.lock);
+	fpm_trace.reserved -= bytes;
+	spin_unlock(&fpm_trace.lock);
+}
+
+/*
+ * Records count pairs at ops, returns false if the record was dropped.
+ * With reserved set the record is taken out of that reservation. The time
+ * is taken under the lock, so the ring is in time order.
+ */
+static bool fpm_trace_add(struct fpm_client *client, u8 method, u8 flags, const u32 *ops, unsigned int count,
+			  unsigned int *reserved) {
+	struct fpm_trace_rec rec;
+	unsigned int len = count * 8;
+	if(!smp_load_acquire(&fpm_trace.enabled)) {
+		return false;
+	}
+	memset(&rec, 0, sizeof(rec));
+	rec.client = client->id;
+	rec.count = count;
+	rec.method = method;
+	rec.prio = READ_ONCE(client->prio);
+	rec.flags = flags;
+	spin_lock(&fpm_trace.lock);
+	if(reserved) {
+		*reserved -= sizeof(rec) + len;
+		fpm_trace.reserved -= sizeof(rec) + len;
+	}
+	else if(kfifo_avail(&fpm_trace.fifo) < fpm_trace.reserved + sizeof(rec) + len) {
+		fpm_trace.lost++;
+		spin_unlock(&fpm_trace.lock);
+		return false;
+	}
+	rec.ts_ns = ktime_get_ns();
+	rec.lost = fpm_trace.lost;
+	fpm_trace.lost = 0;
+	kfifo_in(&fpm_trace.fifo, &rec, sizeof(rec));
+	kfifo_in(&fpm_trace.fifo, ops, len);
+	spin_unlock(&fpm_trace.lock);
+	wake_up_interruptible(&fpm_trace.wait);
+	return true;
+}
+
+static ssize_t fpm_trace_read(struct file *f, char __user *buf, size_t len, loff_t *off) {
+	unsigned int copied;
+	int ret;
+	if(kfifo_is_empty(&fpm_trace.fifo) && (f->f_flags & O_NONBLOCK)) {
+		return READ_ONCE(fpm_trace.enabled) ? -EAGAIN : 0;
+	}
+	ret = wait_event_interruptible(fpm_trace.wait,
+				       !kfifo_is_empty(&fpm_trace.fifo) || !READ_ONCE(fpm_trace.enabled));
+	if(ret) {
+		return ret;
+	}
+	mutex_lock(&fpm_trace.read_lock);
+	ret = kfifo_to_user(&fpm_trace.fifo, buf, len, &copied);
+	mutex_unlock(&fpm_trace.read_lock);
+	return ret ? ret : copied;
+}
+
+static int fpm_trace_enable_get(void *data, u64 *val) {
+	*val = READ_ONCE(fpm_trace.enabled);
+	return 0;
+}
+
+static int fpm_trace_enable_set(void *data, u64 val) {
+	int ret = 0;
+	mutex_lock(&fpm_trace.read_lock);
+	if(val && !kfifo_initialized(&fpm_trace.fifo)) {
+		ret = kfifo_alloc(&fpm_trace.fifo, trace_buf_kb * 1024, GFP_KERNEL);
+		if(ret) {
+			printk(KERN_ERR "[fpm_trace] Could not allocate %u KiB trace buffer\n", trace_buf_kb);
+		}
+	}
+	if(!ret) {
+		/* The ring is set up before writers can see tracing on */
+		smp_store_release(&fpm_trace.enabled, !!val);
+		printk(KERN_INFO "[fpm_trace] Request trace %s\n", val ? "enabled" : "disabled");
+	}
+	mutex_unlock(&fpm_trace.read_lock);
+	wake_up_interruptible(&fpm_trace.wait);
+	return ret;
+}
+
+DEFINE_DEBUGFS_ATTRIBUTE(fpm_trace_enable_fops, fpm_trace_enable_get, fpm_trace_enable_set, "%llu\n");
+
+static const struct file_operations fpm_trace_fops = {
+	.owner	= THIS_MODULE,
+	.read	= fpm_trace_read,
+	.llseek	= no_llseek,
+};
+
+static void fpm_trace_init(void) {
+	fpm_trace.dir = debugfs_create_dir("fpmult", NULL);
+	debugfs_create_file_unsafe("trace_enable", 0600, fpm_trace.dir, NULL, &fpm_trace_enable_fops);
+	debugfs_create_file("trace", 0400, fpm_trace.dir, NULL, &fpm_trace_fops);
+}
+
+static void fpm_trace_exit(void) {
+	/* Blocked readers return before their files go away */
+	smp_store_release(&fpm_trace.enabled, false);
+	wake_up_interruptible(&fpm_trace.wait);
+	debugfs_remove_recursive(fpm_trace.dir);
+	kfifo_free(&fpm_trace.fifo);
+}
 
 /* -------------------------------------- */
 /* -------INIT AND EXIT FUNCTIONS-------- */
@@ -167,7 +711,7 @@ static int __init fpm_init(void) {
 		goto fail_0;
 	}
 	printk(KERN_INFO "[fpm_init] Successful class chardev create!\n");
-	my_device = device_create(my_class, NULL, MKDEV(MAJOR(my_dev_id), 0), NULL, "fpmult");
+	my_device = device_create_with_groups(my_class, NULL, MKDEV(MAJOR(my_dev_id), 0), NULL, fpm_groups, "fpmult");
 	if(my_device == NULL) {
 		goto fail_1;
 	}
@@ -181,9 +725,14 @@ static int __init fpm_init(void) {
 		goto fail_2;
 	}
 	printk(KERN_INFO "[fpm_init] Module init done\n");
+	fpm_trace_init();
 
+	if(emulate) {
+		/* The class device has no DMA configuration of its own */
+		dma_coerce_mask_and_coherent(my_device, DMA_BIT_MASK(32));
+	}
 	tx_vir_buffer = dma_alloc_coherent(my_device, MAX_PKT_LEN, &tx_phy_buffer, GFP_DMA | GFP_KERNEL);
-	printk(KERN_INFO "[fpm_init] Virtual and physical addresses coherent starting at %#x and ending at %#x\n", tx_phy_buffer, tx_phy_buffer+(uint)(MAX_PKT_LEN));
+	printk(KERN_INFO "[fpm_init] Virtual and physical addresses coherent starting at %pad\n", &tx_phy_buffer);
 	if(!tx_vir_buffer) {
 		printk(KERN_ALERT "[fpm_init] Could not allocate dma_alloc_coherent");
 		goto fail_3;
@@ -193,8 +742,18 @@ static int __init fpm_init(void) {
 	}
 	*tx_vir_buffer = 0;
 	printk(KERN_INFO "[fpm_init] Memory reset.\n");
-	return platform_driver_register(&fpm_driver);
+	ret = platform_driver_register(&fpm_driver);
+	if(ret || !emulate) {
+		return ret;
+	}
+	ret = fpm_emu_register();
+	if(!ret) {
+		return 0;
+	}
+	platform_driver_unregister(&fpm_driver);
+	dma_free_coherent(my_device, MAX_PKT_LEN, tx_vir_buffer, tx_phy_buffer);
 	fail_3:
+		fpm_trace_exit();
 		cdev_del(my_cdev);
 	fail_2:
 		device_destroy(my_class, MKDEV(MAJOR(my_dev_id),0));
@@ -208,6 +767,12 @@ static int __init fpm_init(void) {
 static void __exit fpm_exit(void) {
 	/* Exit Device Module */
 	platform_driver_unregister(&fpm_driver);
+	if(emulate) {
+		fpm_emu_unregister();
+	}
+	dma_free_coherent(my_device, MAX_PKT_LEN, tx_vir_buffer, tx_phy_buffer);
+	fpm_cache_resize(0);
+	fpm_trace_exit();
 	cdev_del(my_cdev);
 	device_destroy(my_class, MKDEV(MAJOR(my_dev_id),0));
 	class_destroy(my_class);
@@ -225,6 +790,10 @@ module_exit(fpm_exit);
 static int fpm_probe(struct platform_device *pdev)  {
 	struct resource *r_mem;
 	int rc = 0;
+	if(emulate && !pdev->dev.of_node) {
+		/* Only the devices fpm_emu_register() created, DT nodes are real DMAs */
+		return fpm_emu_probe(pdev);
+	}
 	switch(device_fsm){
 		case 0:
 			r_mem = platform_get_resource(pdev, IORESOURCE_MEM, 0);
@@ -233,7 +802,7 @@ static int fpm_probe(struct platform_device *pdev)  {
 				return -ENODEV;
 			}
 			printk(KERN_ALERT "[fpm_probe] Probing dma0_p\n");
-			dma0_p = (struct fpm_info *) kmalloc(sizeof(struct fpm_info), GFP_KERNEL);
+			dma0_p = (struct fpm_info *) kzalloc(sizeof(struct fpm_info), GFP_KERNEL);
 			if(!dma0_p) {
 				printk(KERN_ALERT "[fpm_probe] Could not allocate dma0 device\n");
 				return -ENOMEM;
@@ -251,7 +820,7 @@ static int fpm_probe(struct platform_device *pdev)  {
 				rc = -EIO;
 				goto error02;
 			}
-			printk(KERN_INFO "[fpm_probe] dma0 base address start at %#x\n", (u32)dma0_p->base_addr);
+			printk(KERN_INFO "[fpm_probe] dma0 base address start at %p\n", dma0_p->base_addr);
 			dma0_p->irq_num = platform_get_irq(pdev, 0);
 			if(!dma0_p->irq_num) {
 				printk(KERN_ERR "[fpm_probe] Could not get IRQ resource for dma0\n");
@@ -267,7 +836,7 @@ static int fpm_probe(struct platform_device *pdev)  {
 				printk(KERN_INFO "[fpm_probe] Registered IRQ %d\n", dma0_p->irq_num);
 			}
 			enable_irq(dma0_p->irq_num);
-			dma_init0(dma0_p->base_addr);
+			dma_init0(dma0_p);
 			printk(KERN_NOTICE "[fpm_probe] fpm platform driver registered - dma0\n");
 			device_fsm++;
 			return 0;
@@ -286,7 +855,7 @@ static int fpm_probe(struct platform_device *pdev)  {
 				return -ENODEV;
 			}
 			printk(KERN_ALERT "[fpm_probe] Probing dma1_p\n");
-			dma1_p = (struct fpm_info *) kmalloc(sizeof(struct fpm_info), GFP_KERNEL);
+			dma1_p = (struct fpm_info *) kzalloc(sizeof(struct fpm_info), GFP_KERNEL);
 			if(!dma1_p) {
 				printk(KERN_ALERT "[fpm_probe] Could not allocate dma1 device\n");
 				return -ENOMEM;
@@ -304,7 +873,7 @@ static int fpm_probe(struct platform_device *pdev)  {
 				rc = -EIO;
 				goto error12;
 			}
-			printk(KERN_INFO "[fpm_probe] dma1 base address start at %#x\n", (u32)dma1_p->base_addr);
+			printk(KERN_INFO "[fpm_probe] dma1 base address start at %p\n", dma1_p->base_addr);
 			dma1_p->irq_num = platform_get_irq(pdev, 0);
 			if(!dma1_p->irq_num) {
 				printk(KERN_ERR "[fpm_probe] Could not get IRQ resource for dma1\n");
@@ -320,7 +889,7 @@ static int fpm_probe(struct platform_device *pdev)  {
 				printk(KERN_INFO "[fpm_probe] Registered IRQ %d\n", dma1_p->irq_num);
 			}
 			enable_irq(dma1_p->irq_num);
-			dma_init1(dma1_p->base_addr);
+			dma_init1(dma1_p);
 			printk(KERN_NOTICE "[fpm_probe] fpm platform driver registered - dma1\n");
 			device_fsm++;
 			return 0;
@@ -339,7 +908,7 @@ static int fpm_probe(struct platform_device *pdev)  {
 				return -ENODEV;
 			}
 			printk(KERN_ALERT "[fpm_probe] Probing dma2_p\n");
-			dma2_p = (struct fpm_info *) kmalloc(sizeof(struct fpm_info), GFP_KERNEL);
+			dma2_p = (struct fpm_info *) kzalloc(sizeof(struct fpm_info), GFP_KERNEL);
 			if(!dma2_p) {
 				printk(KERN_ALERT "[fpm_probe] Could not allocate dma2 device\n");
 				return -ENOMEM;
@@ -357,7 +926,7 @@ static int fpm_probe(struct platform_device *pdev)  {
 				rc = -EIO;
 				goto error22;
 			}
-			printk(KERN_INFO "[fpm_probe] dma2 base address start at %#x\n",(u32) dma2_p->base_addr);
+			printk(KERN_INFO "[fpm_probe] dma2 base address start at %p\n", dma2_p->base_addr);
 			
 			dma2_p->irq_num = platform_get_irq(pdev, 0);
 			if(!dma2_p->irq_num) {
@@ -374,7 +943,7 @@ static int fpm_probe(struct platform_device *pdev)  {
 				printk(KERN_INFO "[fpm_probe] Registered IRQ %d\n", dma2_p->irq_num);
 			}
 			enable_irq(dma2_p->irq_num);
-			dma_init2(dma2_p->base_addr);		
+			dma_init2(dma2_p);		
 			printk(KERN_NOTICE "[fpm_probe] fpm platform driver registered - dma2\n");	
 			return 0;
 			error23:
@@ -393,6 +962,9 @@ static int fpm_probe(struct platform_device *pdev)  {
 }
 
 static int fpm_remove(struct platform_device *pdev)  {
+	if(emulate && !pdev->dev.of_node) {
+		return fpm_emu_remove(pdev);
+	}
 	switch(device_fsm){
 		case 0:
 			printk(KERN_ALERT "[fpm_remove] dma0_p device platform driver removed\n");
@@ -436,12 +1008,57 @@ static int fpm_remove(struct platform_device *pdev)  {
 /* -------------------------------------- */
 
 int fpm_open(struct inode *pinode, struct file *pfile) {
-	printk(KERN_INFO "[fpm_open] Succesfully opened driver\n");
+	struct fpm_client *client;
+	client = kzalloc(sizeof(struct fpm_client), GFP_KERNEL);
+	if(!client) {
+		printk(KERN_ALERT "[fpm_open] Could not allocate client\n");
+		return -ENOMEM;
+	}
+	mutex_init(&client->lock);
+	init_waitqueue_head(&client->stream_wait);
+	client->prio = FPM_PRIO_NORMAL;
+	client->id = atomic_inc_return(&fpm_client_ids);
+	pfile->private_data = client;
+	pr_debug("[fpm_open] Succesfully opened driver\n");
 	return 0;
 }
 
 int fpm_close(struct inode *pinode, struct file *pfile) {
-	printk(KERN_INFO "[fpm_close] Succesfully closed driver\n");
+	struct fpm_client *client = pfile->private_data;
+	if(client->staging_vir) {
+		dma_free_coherent(my_device, FPM_STAGING_SIZE, client->staging_vir, client->staging_phy);
+	}
+	if(client->shadow_vir) {
+		dma_free_coherent(my_device, FPM_STAGING_SIZE, client->shadow_vir, client->shadow_phy);
+	}
+	kfree(client);
+	pr_debug("[fpm_close] Succesfully closed driver\n");
+	return 0;
+}
+
+/* Allocates the client's staging area on first use, called with client->lock held */
+static int fpm_staging_alloc(struct fpm_client *client) {
+	if(client->staging_vir) {
+		return 0;
+	}
+	client->staging_vir = dma_alloc_coherent(my_device, FPM_STAGING_SIZE, &client->staging_phy, GFP_KERNEL);
+	if(!client->staging_vir) {
+		printk(KERN_ALERT "[fpm_staging_alloc] Could not allocate staging area\n");
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/* Allocates the shadow of the staging area on first use with the cache on, called with client->lock held */
+static int fpm_shadow_alloc(struct fpm_client *client) {
+	if(client->shadow_vir) {
+		return 0;
+	}
+	client->shadow_vir = dma_alloc_coherent(my_device, FPM_STAGING_SIZE, &client->shadow_phy, GFP_KERNEL);
+	if(!client->shadow_vir) {
+		printk(KERN_ALERT "[fpm_shadow_alloc] Could not allocate shadow staging area\n");
+		return -ENOMEM;
+	}
 	return 0;
 }
 
@@ -449,53 +1066,67 @@ int fpm_close(struct inode *pinode, struct file *pfile) {
 /* -------READ AND WRITE FUNCTIONS------- */
 /* -------------------------------------- */
 
-ssize_t fpm_read(struct file *pfile, char __user *buf, size_t length, loff_t *offset) {		
+/* Hands out one "RES n: 0x.." line per call, then 0 once all results were read */
+static ssize_t fpm_text_read(struct fpm_client *client, struct iov_iter *to) {
 	char buff[BUFF_SIZE];
-	int ret = 0; 
+	size_t length = 0;
 
-	if(endRead) {
-		endRead = 0;
+	mutex_lock(&client->lock);
+	if(client->endRead) {
+		client->endRead = 0;
+		mutex_unlock(&client->lock);
 		return 0;
 	}
-	if(pos_out > 0) {
-		if(counter_out < pos_out) {
-			length = scnprintf(buff, BUFF_SIZE, "		RES %d: %#x\n", (counter_out + 1), izlazni_niz[counter_out]);
-			ret = copy_to_user(buf, buff, length);
-			if(ret) {
-				printk(KERN_WARNING "[fpm_read] Copy to user failed\n");
+	if(client->pos_out > 0) {
+		if(client->counter_out < client->pos_out) {
+			length = scnprintf(buff, BUFF_SIZE, "		RES %d: %#x\n", (client->counter_out + 1), client->izlazni_niz[client->counter_out]);
+			if(copy_to_iter(buff, length, to) != length) {
+				printk(KERN_WARNING "[fpm_text_read] Copy to user failed\n");
+				mutex_unlock(&client->lock);
 				return -EFAULT;
 			}
-			counter_out++;
+			client->counter_out++;
 		}
-		if(counter_out == pos_out) {
-			endRead = 1;
-			counter_out = 0;
-			pos_out = 0;
-			pos_in = 0;
-			cnt_in = 0;
-			cnt = 0;
+		if(client->counter_out == client->pos_out) {
+			client->endRead = 1;
+			client->counter_out = 0;
+			client->pos_out = 0;
+			client->pos_in = 0;
+			client->cnt_in = 0;
+			client->cnt = 0;
 		}
 	}	
 	else {
-		printk(KERN_INFO "[fpm_read] Driver is empty\n");
+		pr_debug("[fpm_text_read] Driver is empty\n");
+		mutex_unlock(&client->lock);
 		return -EFAULT;
 	}
-	printk(KERN_INFO "[fpm_read] Succesfully read driver\n");
+	mutex_unlock(&client->lock);
+	pr_debug("[fpm_text_read] Succesfully read driver\n");
 	return length;
 }
 
-ssize_t fpm_write(struct file *pfile, const char __user *buf, size_t length, loff_t *offset) {	
-	char buff[length + 1];
+/* Parses "0x.., 0x..;" pairs and multiplies them, the results wait for fpm_text_read */
+static ssize_t fpm_text_write(struct fpm_client *client, struct iov_iter *from) {
+	size_t length = iov_iter_count(from);
+	char buff[WRITE_BUFF_SIZE];
 	int brojac = 1;
 	int flag = 0;
 	int pomeraj = 0;
 	int ret;
-	char str1[50];
-	char str2[50];
+	char str1[51];
+	char str2[51];
 	u32 tmp1, tmp2;
-	ret = copy_from_user(buff, buf, length);
-    	if (ret) {
-       		 printk(KERN_WARNING "[fpm_write] copy from user failed\n");
+	unsigned long hit;
+	unsigned int misses;
+	bool cached;
+	int err = 0;
+	if(length >= WRITE_BUFF_SIZE) {
+		printk(KERN_WARNING "[fpm_text_write] Too much requests for multiplication\n");
+		return -EINVAL;
+	}
+    	if (copy_from_iter(buff, length, from) != length) {
+       		 printk(KERN_WARNING "[fpm_text_write] copy from user failed\n");
        		 return -EFAULT;
    	}
 	buff[length] = '\0';
@@ -506,57 +1137,287 @@ ssize_t fpm_write(struct file *pfile, const char __user *buf, size_t length, lof
 		}
 	}
 
-	if(pos_in >= (NIZ_SIZE*2 - 1)) {
-		cnt = 1;
-		printk(KERN_WARNING "[fpm_write] Driver is already full\n");
+	/* Operands and results of the text protocol belong to this file */
+	mutex_lock(&client->lock);
+	if(client->pos_in >= (NIZ_SIZE*2 - 1)) {
+		client->cnt = 1;
+		printk(KERN_WARNING "[fpm_text_write] Driver is already full\n");
 		goto label1;
 	}
 	while(brojac != 1) {
 		if(brojac > (NIZ_SIZE + 1)) {
-			printk(KERN_WARNING "[fpm_write] Too much requests for multiplication\n");
+			printk(KERN_WARNING "[fpm_text_write] Too much requests for multiplication\n");
 			flag = 1;
 			break;
 		}
-		if(pos_in < (NIZ_SIZE*2-1)) {
+		if(client->pos_in < (NIZ_SIZE*2-1)) {
 			ret = sscanf(buff + pomeraj, "%50[^,], %50[^;];", str1, str2);
 			if(ret != 2) {
-				printk(KERN_WARNING "[fpm_write] Parsing failed\n");
+				printk(KERN_WARNING "[fpm_text_write] Parsing failed\n");
+				mutex_unlock(&client->lock);
        				return -EFAULT;
 			}
 			sscanf(str1, "%x", &tmp1);
-			ulazni_niz[pos_in] = tmp1;
-			printk(KERN_INFO "[fpm_write] BROJ %d: %#x\n", (pos_in + 1), ulazni_niz[pos_in]);	
-			pos_in++;
+			client->ulazni_niz[client->pos_in] = tmp1;
+			pr_debug("[fpm_text_write] BROJ %d: %#x\n", (client->pos_in + 1), client->ulazni_niz[client->pos_in]);	
+			client->pos_in++;
 			sscanf(str2, "%x", &tmp2);
-			ulazni_niz[pos_in] = tmp2;
-			printk(KERN_INFO "[fpm_write] BROJ %d: %#x\n", (pos_in + 1), ulazni_niz[pos_in]);
-			pos_in++; 
+			client->ulazni_niz[client->pos_in] = tmp2;
+			pr_debug("[fpm_text_write] BROJ %d: %#x\n", (client->pos_in + 1), client->ulazni_niz[client->pos_in]);
+			client->pos_in++; 
 			pomeraj = pomeraj +  strlen(str1) + strlen(str2) + 3;
 			--brojac;
 		}
 		else {
-			printk(KERN_WARNING "[fpm_write] Driver is full\n");
+			printk(KERN_WARNING "[fpm_text_write] Driver is full\n");
 			break;
 		}
 	}
 
-	printk(KERN_INFO "[fpm_write] Succesfully wrote in driver\n");
+	pr_debug("[fpm_text_write] Succesfully wrote in driver\n");
 	label1:
-		if(cnt == 0  && flag != 1) {
-			cnt++;
-			*tx_vir_buffer = ulazni_niz[cnt_in++];	
-			dma_simple_write1(tx_phy_buffer, MAX_PKT_LEN, dma0_p->base_addr);
+		if(client->cnt == 0  && flag != 1) {
+			client->cnt++;
+			if(client->cnt_in < client->pos_in - 1) {
+				fpm_trace_add(client, FPM_TRACE_TEXT, 0, &client->ulazni_niz[client->cnt_in], (client->pos_in - client->cnt_in) / 2, NULL);
+			}
+			/* At most NIZ_SIZE pairs, always a single burst */
+			err = fpm_sched_acquire(client->prio);
+			if(err) {
+				/* Killed while waiting for the FPM, the pairs stay queued */
+				goto label2;
+			}
+			while(client->cnt_in < (client->pos_in - 1)) {
+				hit = 0;
+				misses = 1;
+				cached = fpm_cache_lookup(&client->ulazni_niz[client->cnt_in], &client->izlazni_niz[client->pos_out], 0, 1, &hit, &misses);
+				if(misses) {
+					err = fpm_mul_tx(client->ulazni_niz[client->cnt_in], client->ulazni_niz[client->cnt_in + 1], &client->izlazni_niz[client->pos_out]);
+					if(err) {
+						/* Drop the pairs that were not multiplied, the results so far stay readable */
+						printk(KERN_ERR "[fpm_text_write] Multiplication failed\n");
+						client->pos_in = client->cnt_in;
+						break;
+					}
+				}
+				if(cached && misses) {
+					fpm_cache_fill(&client->ulazni_niz[client->cnt_in], &client->izlazni_niz[client->pos_out], 0, 1, &hit);
+				}
+				pr_debug("[fpm_text_write] RESULT %d: %#x\n", (client->pos_out + 1), client->izlazni_niz[client->pos_out]);
+				client->pos_out++;
+				client->cnt_in += 2;
+			}
+			fpm_sched_release();
+			label2:
+				client->cnt = 0;
+		}
+		mutex_unlock(&client->lock);
+		if(err) {
+			return err;
 		}
 		return length;
 }
 
+/* -------------------------------------- */
+/* -----STREAM READ AND WRITE (SPLICE)--- */
+/* -------------------------------------- */
+
+/*
+ * Every read and write path (read/write, readv/writev, aio, splice,
+ * sendfile) ends up in read_iter/write_iter, and the file's mode decides
+ * the wire format. FPM_MODE_TEXT is the "0x.., 0x..;" protocol.
+ * FPM_MODE_STREAM takes raw operand pairs straight into the staging area,
+ * multiplies every complete pair and hands raw results back, so pipes and
+ * files move data to and from the DMA staging memory without a userspace
+ * buffer. Reads wait for results and writes for room, so a stream larger
+ * than the staging area needs a reader running alongside the writer, or
+ * non-blocking I/O driven by poll. FPM_IOC_STREAM_END lets reads return 0
+ * once the last result is out.
+ */
+
+/* Starts the staging area over once every result has been read, called with client->lock held */
+static void fpm_stream_rewind(struct fpm_client *client) {
+	unsigned int partial = client->in_bytes - client->in_done * 8;
+	if(client->out_bytes < client->in_done * 4) {
+		return;
+	}
+	if(partial) {
+		memmove(client->staging_vir, (u8 *)client->staging_vir + client->in_done * 8, partial);
+	}
+	client->in_bytes = partial;
+	client->in_done = 0;
+	client->out_bytes = 0;
+}
+
+/* Results are all read, so the next write can start the staging area over */
+static bool fpm_stream_drained(struct fpm_client *client) {
+	return READ_ONCE(client->out_bytes) >= READ_ONCE(client->in_done) * 4;
+}
+
+/* A read would not block: results are ready, the stream ended or the file left stream mode */
+static bool fpm_stream_readable(struct fpm_client *client) {
+	return !fpm_stream_drained(client) || READ_ONCE(client->stream_end) || !READ_ONCE(client->stream);
+}
+
+/* A write would not block, after the end it fails right away */
+static bool fpm_stream_writable(struct fpm_client *client) {
+	return READ_ONCE(client->in_bytes) < FPM_STAGING_RES_OFF || fpm_stream_drained(client) || READ_ONCE(client->stream_end);
+}
+
+static ssize_t fpm_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+	struct fpm_client *client = iocb->ki_filp->private_data;
+	size_t room;
+	size_t copied;
+	unsigned int pairs;
+	ssize_t ret;
+
+	if(!READ_ONCE(client->stream)) {
+		return fpm_text_write(client, from);
+	}
+	if(!dma0_p || !dma1_p || !dma2_p) {
+		return -ENODEV;
+	}
+	if(!iov_iter_count(from)) {
+		return 0;
+	}
+	mutex_lock(&client->lock);
+	if(client->stream_end) {
+		ret = -EPIPE;
+		goto out;
+	}
+	ret = fpm_staging_alloc(client);
+	if(ret) {
+		goto out;
+	}
+	fpm_stream_rewind(client);
+	while(client->in_bytes == FPM_STAGING_RES_OFF) {
+		/* Staging area is full until the results are read */
+		mutex_unlock(&client->lock);
+		if((iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT)) {
+			return -EAGAIN;
+		}
+		if(wait_event_killable(client->stream_wait, fpm_stream_writable(client))) {
+			return -EINTR;
+		}
+		mutex_lock(&client->lock);
+		if(client->stream_end) {
+			ret = -EPIPE;
+			goto out;
+		}
+		fpm_stream_rewind(client);
+	}
+	room = FPM_STAGING_RES_OFF - client->in_bytes;
+	copied = copy_from_iter((u8 *)client->staging_vir + client->in_bytes, min(room, iov_iter_count(from)), from);
+	if(!copied) {
+		ret = -EFAULT;
+		goto out;
+	}
+	client->in_bytes += copied;
+	pairs = client->in_bytes / 8 - client->in_done;
+	if(pairs) {
+		fpm_trace_add(client, FPM_TRACE_STREAM, 0, client->staging_vir + client->in_done * 2, pairs, NULL);
+		ret = fpm_mul_staging(client, client->in_done, pairs);
+		if(ret) {
+			/* Nothing of this write is taken, it can be retried as is */
+			client->in_bytes -= copied;
+			goto out;
+		}
+		client->in_done += pairs;
+		wake_up(&client->stream_wait);
+	}
+	ret = copied;
+	out:
+		mutex_unlock(&client->lock);
+		return ret;
+}
+
+static ssize_t fpm_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+	struct fpm_client *client = iocb->ki_filp->private_data;
+	u8 *res;
+	size_t avail;
+	size_t copied;
+
+	if(!READ_ONCE(client->stream)) {
+		return fpm_text_read(client, to);
+	}
+	if(!iov_iter_count(to)) {
+		return 0;
+	}
+	mutex_lock(&client->lock);
+	while(!fpm_stream_readable(client)) {
+		/* No results yet, the writer has not caught up */
+		mutex_unlock(&client->lock);
+		if((iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT)) {
+			return -EAGAIN;
+		}
+		if(wait_event_killable(client->stream_wait, fpm_stream_readable(client))) {
+			return -EINTR;
+		}
+		mutex_lock(&client->lock);
+	}
+	if(!client->staging_vir || !client->stream) {
+		mutex_unlock(&client->lock);
+		return 0;
+	}
+	res = (u8 *)client->staging_vir + FPM_STAGING_RES_OFF;
+	/* Nothing left after the end of the stream reads as EOF */
+	avail = client->in_done * 4 - client->out_bytes;
+	copied = copy_to_iter(res + client->out_bytes, min(avail, iov_iter_count(to)), to);
+	client->out_bytes += copied;
+	fpm_stream_rewind(client);
+	mutex_unlock(&client->lock);
+	if(copied) {
+		wake_up(&client->stream_wait);
+	}
+	if(!copied && avail) {
+		return -EFAULT;
+	}
+	return copied;
+}
+
+static __poll_t fpm_poll(struct file *f, poll_table *wait) {
+	struct fpm_client *client = f->private_data;
+	__poll_t mask = 0;
+	if(!READ_ONCE(client->stream)) {
+		/* The text protocol never blocks */
+		return EPOLLIN | EPOLLRDNORM | EPOLLOUT | EPOLLWRNORM;
+	}
+	poll_wait(f, &client->stream_wait, wait);
+	mutex_lock(&client->lock);
+	if(fpm_stream_readable(client)) {
+		mask |= EPOLLIN | EPOLLRDNORM;
+	}
+	if(fpm_stream_writable(client)) {
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	}
+	mutex_unlock(&client->lock);
+	return mask;
+}
+
 /* -------------------------------------- */
 /* ------------MMAP FUNCTION------------- */
 /* -------------------------------------- */
 
 static int fpm_mmap(struct file *f, struct vm_area_struct *vma_s) {
+	struct fpm_client *client = f->private_data;
 	int ret = 0;
 	long length = vma_s->vm_end - vma_s->vm_start;
+	if(vma_s->vm_pgoff == FPM_STAGING_PGOFF) {
+		printk(KERN_INFO "[fpm_dma_mmap] Staging area is being memory mapped\n");
+		mutex_lock(&client->lock);
+		ret = fpm_staging_alloc(client);
+		if(!ret) {
+			/* dma_mmap_coherent treats vm_pgoff as an offset into the buffer */
+			vma_s->vm_pgoff = 0;
+			ret = dma_mmap_coherent(my_device, vma_s, client->staging_vir, client->staging_phy, FPM_STAGING_SIZE);
+			vma_s->vm_pgoff = FPM_STAGING_PGOFF;
+		}
+		mutex_unlock(&client->lock);
+		if(ret < 0) {
+			printk(KERN_ERR "[fpm_dma_mmap] Memory map staging area failed\n");
+		}
+		return ret;
+	}
 	printk(KERN_INFO "[fpm_dma_mmap] DMA TX Buffer is being memory mapped\n");
 	ret = dma_mmap_coherent(my_device, vma_s, tx_vir_buffer, tx_phy_buffer, length);
 	if(ret < 0) {
@@ -566,129 +1427,951 @@ static int fpm_mmap(struct file *f, struct vm_area_struct *vma_s) {
 	return 0;
 }
 
+/* -------------------------------------- */
+/* ------------IOCTL FUNCTION------------ */
+/* -------------------------------------- */
+
+static long fpm_ioctl(struct file *pfile, unsigned int cmd, unsigned long arg) {
+	struct fpm_client *client = pfile->private_data;
+	struct fpm_batch batch;
+	u32 prio;
+	u32 mode;
+	int ret;
+	switch(cmd) {
+		case FPM_IOC_MUL:
+			if(copy_from_user(&batch, (void __user *)arg, sizeof(batch))) {
+				printk(KERN_WARNING "[fpm_ioctl] Copy from user failed\n");
+				return -EFAULT;
+			}
+			return fpm_mul_batch(client, &batch);
+		case FPM_IOC_SET_PRIO:
+			if(get_user(prio, (u32 __user *)arg)) {
+				return -EFAULT;
+			}
+			if(prio >= FPM_PRIO_LEVELS) {
+				return -EINVAL;
+			}
+			if(prio == FPM_PRIO_HIGH && !capable(CAP_SYS_NICE)) {
+				return -EPERM;
+			}
+			WRITE_ONCE(client->prio, prio);
+			return 0;
+		case FPM_IOC_GET_PRIO:
+			return put_user(READ_ONCE(client->prio), (u32 __user *)arg);
+		case FPM_IOC_SET_MODE:
+			if(get_user(mode, (u32 __user *)arg)) {
+				return -EFAULT;
+			}
+			if(mode != FPM_MODE_TEXT && mode != FPM_MODE_STREAM) {
+				return -EINVAL;
+			}
+			ret = 0;
+			mutex_lock(&client->lock);
+			if(client->in_bytes || client->pos_in || client->pos_out) {
+				/* Data of the other format is still pending */
+				ret = -EBUSY;
+			}
+			else {
+				WRITE_ONCE(client->stream, mode == FPM_MODE_STREAM);
+				WRITE_ONCE(client->stream_end, false);
+			}
+			mutex_unlock(&client->lock);
+			wake_up(&client->stream_wait);
+			return ret;
+		case FPM_IOC_GET_MODE:
+			return put_user(READ_ONCE(client->stream) ? FPM_MODE_STREAM : FPM_MODE_TEXT, (u32 __user *)arg);
+		case FPM_IOC_STREAM_END:
+			mutex_lock(&client->lock);
+			if(!client->stream) {
+				mutex_unlock(&client->lock);
+				return -EINVAL;
+			}
+			/* A trailing partial pair has no result, it is dropped */
+			client->in_bytes = client->in_done * 8;
+			WRITE_ONCE(client->stream_end, true);
+			fpm_stream_rewind(client);
+			mutex_unlock(&client->lock);
+			wake_up(&client->stream_wait);
+			return 0;
+		default:
+			return -ENOTTY;
+	}
+}
+
+/* Runs count pairs already placed in the staging area, starting at pair first, through the FPM */
+static int fpm_mul_staging(struct fpm_client *client, unsigned int first, unsigned int count) {
+	dma_addr_t ops_phy = client->staging_phy + FPM_STAGING_OPS_OFF;
+	dma_addr_t res_phy = client->staging_phy + FPM_STAGING_RES_OFF;
+	u32 *ops = client->staging_vir + FPM_STAGING_OPS_OFF / sizeof(u32);
+	u32 *res = client->staging_vir + FPM_STAGING_RES_OFF / sizeof(u32);
+	u32 *user_res = res;
+	unsigned int burst = READ_ONCE(burst_pairs);
+	unsigned int misses = count;
+	unsigned int done = 0;
+	bool shadow = false;
+	bool cached = false;
+	int ret = 0;
+
+	if(READ_ONCE(fpm_cache.entries) && !fpm_shadow_alloc(client)) {
+		/*
+		 * The cache is shared by all clients and the staging area is mapped
+		 * writable, so the operands are read from it exactly once and the
+		 * FPM and the cache only work on the kernel copy.
+		 */
+		memcpy(client->shadow_vir + FPM_STAGING_OPS_OFF / sizeof(u32) + 2 * first, ops + 2 * first, count * 8);
+		ops = client->shadow_vir + FPM_STAGING_OPS_OFF / sizeof(u32);
+		res = client->shadow_vir + FPM_STAGING_RES_OFF / sizeof(u32);
+		ops_phy = client->shadow_phy + FPM_STAGING_OPS_OFF;
+		res_phy = client->shadow_phy + FPM_STAGING_RES_OFF;
+		shadow = true;
+		/* Cache hits complete here, only the misses wait for the FPM */
+		cached = fpm_cache_lookup(ops, res, first, count, client->cache_hit, &misses);
+	}
+	if(!misses) {
+		memcpy(user_res + first, res + first, count * 4);
+		return 0;
+	}
+	ret = fpm_sched_acquire(client->prio);
+	if(ret) {
+		return ret;
+	}
+	for(unsigned int i = first; i < first + count; i++) {
+		if(cached && test_bit(i, client->cache_hit)) {
+			continue;
+		}
+		if(done == burst) {
+			/* Burst boundary, let a waiting client of the same or a higher class in */
+			fpm_sched_release();
+			ret = fpm_sched_acquire(client->prio);
+			if(ret) {
+				return ret;
+			}
+			done = 0;
+		}
+		ret = fpm_mul_pair(ops_phy + i * 8, ops_phy + i * 8 + 4, res_phy + i * 4);
+		if(ret) {
+			break;
+		}
+		done++;
+	}
+	fpm_sched_release();
+	if(shadow) {
+		memcpy(user_res + first, res + first, count * 4);
+	}
+	if(cached && !ret) {
+		fpm_cache_fill(ops, res, first, count, client->cache_hit);
+	}
+	return ret;
+}
+
+static int fpm_mul_batch(struct fpm_client *client, struct fpm_batch *batch) {
+	u32 __user *ops = u64_to_user_ptr(batch->ops);
+	u32 __user *res = u64_to_user_ptr(batch->res);
+	u32 *staging_res;
+	unsigned int done = 0;
+	unsigned int chunk;
+	unsigned int chunks = DIV_ROUND_UP(batch->count, FPM_STAGING_PAIRS);
+	unsigned int reserved = 0;
+	int ret = 0;
+
+	if(!dma0_p || !dma1_p || !dma2_p) {
+		return -ENODEV;
+	}
+	mutex_lock(&client->lock);
+	if(client->in_bytes) {
+		/* The staging area holds stream data that was not read back yet */
+		mutex_unlock(&client->lock);
+		return -EBUSY;
+	}
+	if(batch->flags & FPM_BATCH_STAGING) {
+		/* Operands are already in place, results stay in the mapped area */
+		if(!client->staging_vir || batch->count > FPM_STAGING_PAIRS) {
+			ret = -EINVAL;
+		}
+		else {
+			fpm_trace_add(client, FPM_TRACE_STAGING, 0, client->staging_vir, batch->count, NULL);
+			ret = fpm_mul_staging(client, 0, batch->count);
+		}
+		mutex_unlock(&client->lock);
+		return ret;
+	}
+	ret = fpm_staging_alloc(client);
+	if(ret) {
+		mutex_unlock(&client->lock);
+		return ret;
+	}
+	staging_res = client->staging_vir + FPM_STAGING_RES_OFF / sizeof(u32);
+	/* The batch is recorded whole or not at all */
+	if(fpm_trace_reserve((u64)chunks * sizeof(struct fpm_trace_rec) + (u64)batch->count * 8, chunks)) {
+		reserved = chunks * sizeof(struct fpm_trace_rec) + batch->count * 8;
+	}
+	while(done < batch->count) {
+		if(fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		chunk = min_t(unsigned int, batch->count - done, FPM_STAGING_PAIRS);
+		if(copy_from_user(client->staging_vir, ops + 2 * done, chunk * 8)) {
+			printk(KERN_WARNING "[fpm_mul_batch] Copy from user failed\n");
+			ret = -EFAULT;
+			break;
+		}
+		if(reserved) {
+			fpm_trace_add(client, FPM_TRACE_IOCTL, done ? FPM_TRACE_CONT : 0, client->staging_vir, chunk, &reserved);
+		}
+		ret = fpm_mul_staging(client, 0, chunk);
+		if(ret) {
+			break;
+		}
+		if(copy_to_user(res + done, staging_res, chunk * 4)) {
+			printk(KERN_WARNING "[fpm_mul_batch] Copy to user failed\n");
+			ret = -EFAULT;
+			break;
+		}
+		done += chunk;
+	}
+	/* A batch that stopped early leaves part of its room unused */
+	fpm_trace_unreserve(reserved);
+	mutex_unlock(&client->lock);
+	return ret;
+}
+
+/* -------------------------------------- */
+/* -------REGISTER ACCESS FUNCTIONS------ */
+/* -------------------------------------- */
+
+static u32 fpm_ioread32(struct fpm_info *dev, u32 reg) {
+	if(dev->emu) {
+		return fpm_emu_read(dev->emu, reg);
+	}
+	return ioread32(dev->base_addr + reg);
+}
+
+static void fpm_iowrite32(struct fpm_info *dev, u32 val, u32 reg) {
+	if(dev->emu) {
+		fpm_emu_write(dev->emu, reg, val);
+		return;
+	}
+	iowrite32(val, dev->base_addr + reg);
+}
+
 /* -------------------------------------- */
 /* ------------DMA FUNCTIONS------------- */
 /* -------------------------------------- */
 
-int dma_init0(void __iomem *base_address) {
+/* DMACR_RESET clears itself once the channel is back in its reset state */
+static int fpm_dma_reset_wait(struct fpm_info *dev, u32 reg) {
+	ktime_t deadline = ktime_add_us(ktime_get(), DMA_RESET_TIMEOUT_US);
+	while(fpm_ioread32(dev, reg) & DMACR_RESET) {
+		if(ktime_after(ktime_get(), deadline)) {
+			return -ETIMEDOUT;
+		}
+		cpu_relax();
+	}
+	return 0;
+}
+
+/* Spins until the ISR ends the transfer or dma_timeout_us passes */
+static int fpm_dma_wait(volatile int *over, volatile u32 *err) {
+	ktime_t deadline = ktime_add_us(ktime_get(), READ_ONCE(dma_timeout_us));
+	/* Pairs with the smp_store_release() in the ISRs, err is set before over is cleared */
+	while(smp_load_acquire(over) == 1) {
+		if(ktime_after(ktime_get(), deadline)) {
+			return -ETIMEDOUT;
+		}
+		cpu_relax();
+	}
+	return smp_load_acquire(err) ? -EIO : 0;
+}
+
+int dma_init0(struct fpm_info *dev) {
 	u32 MM2S_DMACR_val = 0;
 	u32 enInterrupt = 0;
-	iowrite32(0x0, base_address + MM2S_DMACR_REG);
-	iowrite32(DMACR_RESET, base_address + MM2S_DMACR_REG);
-	MM2S_DMACR_val = ioread32(base_address + MM2S_DMACR_REG);
+	fpm_iowrite32(dev, 0x0, MM2S_DMACR_REG);
+	fpm_iowrite32(dev, DMACR_RESET, MM2S_DMACR_REG);
+	if(fpm_dma_reset_wait(dev, MM2S_DMACR_REG)) {
+		printk(KERN_ERR "[dma0_init] DMA0 did not come out of reset\n");
+		return -EIO;
+	}
+	MM2S_DMACR_val = fpm_ioread32(dev, MM2S_DMACR_REG);
 	enInterrupt = MM2S_DMACR_val | IOC_IRQ_EN | ERR_IRQ_EN;
-	iowrite32(enInterrupt, base_address + MM2S_DMACR_REG);	
+	fpm_iowrite32(dev, enInterrupt, MM2S_DMACR_REG);	
 	printk(KERN_INFO "[dma0_init] Successfully initialized DMA0 \n");
 	return 0;
 }
-int dma_init1(void __iomem *base_address) {
+int dma_init1(struct fpm_info *dev) {
 	u32 MM2S_DMACR_val = 0;
 	u32 enInterrupt = 0;
-	iowrite32(0x0, base_address + MM2S_DMACR_REG);
-	iowrite32(DMACR_RESET, base_address + MM2S_DMACR_REG);
-	MM2S_DMACR_val = ioread32(base_address + MM2S_DMACR_REG);
+	fpm_iowrite32(dev, 0x0, MM2S_DMACR_REG);
+	fpm_iowrite32(dev, DMACR_RESET, MM2S_DMACR_REG);
+	if(fpm_dma_reset_wait(dev, MM2S_DMACR_REG)) {
+		printk(KERN_ERR "[dma1_init] DMA1 did not come out of reset\n");
+		return -EIO;
+	}
+	MM2S_DMACR_val = fpm_ioread32(dev, MM2S_DMACR_REG);
 	enInterrupt = MM2S_DMACR_val | IOC_IRQ_EN | ERR_IRQ_EN;
-	iowrite32(enInterrupt, base_address + MM2S_DMACR_REG);	
+	fpm_iowrite32(dev, enInterrupt, MM2S_DMACR_REG);	
 	printk(KERN_INFO "[dma1_init] Successfully initialized DMA1 \n");
 	return 0;
 }
-int dma_init2(void __iomem *base_address) {
+int dma_init2(struct fpm_info *dev) {
 	u32 S2MM_DMACR_val = 0;
 	u32 enInterrupt = 0;
-	iowrite32(0x0, base_address + S2MM_DMACR_REG);
-	iowrite32(DMACR_RESET, base_address + S2MM_DMACR_REG);
-	S2MM_DMACR_val = ioread32(base_address + S2MM_DMACR_REG);
+	fpm_iowrite32(dev, 0x0, S2MM_DMACR_REG);
+	fpm_iowrite32(dev, DMACR_RESET, S2MM_DMACR_REG);
+	if(fpm_dma_reset_wait(dev, S2MM_DMACR_REG)) {
+		printk(KERN_ERR "[dma2_init] DMA2 did not come out of reset\n");
+		return -EIO;
+	}
+	S2MM_DMACR_val = fpm_ioread32(dev, S2MM_DMACR_REG);
 	enInterrupt = S2MM_DMACR_val | IOC_IRQ_EN | ERR_IRQ_EN;
-	iowrite32(enInterrupt, base_address + S2MM_DMACR_REG);	
+	fpm_iowrite32(dev, enInterrupt, S2MM_DMACR_REG);	
 	printk(KERN_INFO "[dma2_init] Successfully initialized DMA2 \n");
 	return 0;
 }
 
 
-unsigned int dma_simple_write1(dma_addr_t TxBufferPtr, unsigned int pkt_len, void __iomem *base_address) {
+int dma_simple_write1(dma_addr_t TxBufferPtr, unsigned int pkt_len, struct fpm_info *dev) {
 	u32 MM2S_DMACR_val = 0;
 	u32 enInterrupt = 0;
-	MM2S_DMACR_val = ioread32(base_address + MM2S_DMACR_REG);
+	int ret;
+	MM2S_DMACR_val = fpm_ioread32(dev, MM2S_DMACR_REG);
 	enInterrupt = MM2S_DMACR_val | IOC_IRQ_EN | ERR_IRQ_EN;
-	iowrite32(enInterrupt, base_address + MM2S_DMACR_REG);
-	MM2S_DMACR_val = ioread32(base_address + MM2S_DMACR_REG);
+	fpm_iowrite32(dev, enInterrupt, MM2S_DMACR_REG);
+	MM2S_DMACR_val = fpm_ioread32(dev, MM2S_DMACR_REG);
 	MM2S_DMACR_val |= DMACR_RUN_STOP;
+	transaction_err0 = 0;
 	transaction_over0 = 1;
-	iowrite32(MM2S_DMACR_val, base_address + MM2S_DMACR_REG);
-	iowrite32((u32)TxBufferPtr, base_address + MM2S_SA_REG);
-	iowrite32(pkt_len, base_address + MM2S_LENGTH_REG);
-	while(transaction_over0 == 1);
-	printk(KERN_INFO "[dma_simple_write1] Successfully wrote in DMA0 \n");
-	*tx_vir_buffer = ulazni_niz[cnt_in++];
-	dma_simple_write2(tx_phy_buffer, MAX_PKT_LEN, dma1_p->base_addr);		return 0;
-	
-}
-unsigned int dma_simple_write2(dma_addr_t TxBufferPtr, unsigned int pkt_len, void __iomem *base_address) {
+	fpm_iowrite32(dev, MM2S_DMACR_val, MM2S_DMACR_REG);
+	fpm_iowrite32(dev, (u32)TxBufferPtr, MM2S_SA_REG);
+	fpm_iowrite32(dev, pkt_len, MM2S_LENGTH_REG);
+	ret = fpm_dma_wait(&transaction_over0, &transaction_err0);
+	if(ret) {
+		printk(KERN_ERR "[dma_simple_write1] DMA0 transfer %s\n", ret == -ETIMEDOUT ? "timed out" : "failed");
+		return ret;
+	}
+	pr_debug("[dma_simple_write1] Successfully wrote in DMA0 \n");
+	return 0;
+}
+int dma_simple_write2(dma_addr_t TxBufferPtr, unsigned int pkt_len, struct fpm_info *dev) {
 	u32 MM2S_DMACR_val = 0;
 	u32 enInterrupt = 0;
-	MM2S_DMACR_val = ioread32(base_address + MM2S_DMACR_REG);
+	int ret;
+	MM2S_DMACR_val = fpm_ioread32(dev, MM2S_DMACR_REG);
 	enInterrupt = MM2S_DMACR_val | IOC_IRQ_EN | ERR_IRQ_EN;
-	iowrite32(enInterrupt, base_address + MM2S_DMACR_REG);
-	MM2S_DMACR_val = ioread32(base_address + MM2S_DMACR_REG);
+	fpm_iowrite32(dev, enInterrupt, MM2S_DMACR_REG);
+	MM2S_DMACR_val = fpm_ioread32(dev, MM2S_DMACR_REG);
 	MM2S_DMACR_val |= DMACR_RUN_STOP;
+	transaction_err1 = 0;
 	transaction_over1 = 1;
-	iowrite32(MM2S_DMACR_val, base_address + MM2S_DMACR_REG);
-	iowrite32((u32)TxBufferPtr, base_address + MM2S_SA_REG);
-	iowrite32(pkt_len, base_address + MM2S_LENGTH_REG);	
-	while(transaction_over1 == 1);
-	printk(KERN_INFO "[dma_simple_write2] Successfully wrote in DMA1 \n");
-	dma_simple_read(tx_phy_buffer, MAX_PKT_LEN, dma2_p->base_addr);
+	fpm_iowrite32(dev, MM2S_DMACR_val, MM2S_DMACR_REG);
+	fpm_iowrite32(dev, (u32)TxBufferPtr, MM2S_SA_REG);
+	fpm_iowrite32(dev, pkt_len, MM2S_LENGTH_REG);	
+	ret = fpm_dma_wait(&transaction_over1, &transaction_err1);
+	if(ret) {
+		printk(KERN_ERR "[dma_simple_write2] DMA1 transfer %s\n", ret == -ETIMEDOUT ? "timed out" : "failed");
+		return ret;
+	}
+	pr_debug("[dma_simple_write2] Successfully wrote in DMA1 \n");
 	return 0;
 }
-unsigned int dma_simple_read(dma_addr_t TxBufferPtr, unsigned int pkt_len, void __iomem *base_address) {
+int dma_simple_read(dma_addr_t TxBufferPtr, unsigned int pkt_len, struct fpm_info *dev) {
 	u32 S2MM_DMACR_value;
-	S2MM_DMACR_value = ioread32(base_address + S2MM_DMACR_REG);
+	int ret;
+	S2MM_DMACR_value = fpm_ioread32(dev, S2MM_DMACR_REG);
 	S2MM_DMACR_value |= DMACR_RUN_STOP; 	
+	transaction_err2 = 0;
 	transaction_over2 = 1;
-	iowrite32(S2MM_DMACR_value, base_address + S2MM_DMACR_REG);
-	iowrite32((u32)TxBufferPtr, base_address + S2MM_DA_REG);
-	iowrite32(pkt_len, base_address + S2MM_LENGTH_REG);
-	while(transaction_over2 == 1);
-	if(cnt_in < (pos_in - 1)) {
-		*tx_vir_buffer = ulazni_niz[cnt_in++];
-		dma_simple_write1(tx_phy_buffer, MAX_PKT_LEN, dma0_p->base_addr);
-	} 
+	fpm_iowrite32(dev, S2MM_DMACR_value, S2MM_DMACR_REG);
+	fpm_iowrite32(dev, (u32)TxBufferPtr, S2MM_DA_REG);
+	fpm_iowrite32(dev, pkt_len, S2MM_LENGTH_REG);
+	ret = fpm_dma_wait(&transaction_over2, &transaction_err2);
+	if(ret) {
+		printk(KERN_ERR "[dma_simple_read] DMA2 transfer %s\n", ret == -ETIMEDOUT ? "timed out" : "failed");
+		return ret;
+	}
+	pr_debug("[dma_simple_read] Successfully read from DMA2 \n");
+	return 0;
+}
+
+/*
+ * A DMA error or timeout leaves the three channels and the FPM operand
+ * queues out of step, so every channel is reset and initialized again
+ * in place. Only the pair that was in flight is affected, it is retried
+ * up to dma_retries times and then fails. Called while owning the FPM.
+ * Returns -EIO when a channel does not come back, retrying is pointless then.
+ */
+static int fpm_dma_recover(int err) {
+	struct fpm_info *devs[] = { dma0_p, dma1_p, dma2_p };
+	int ret = 0;
+	if(err == -ETIMEDOUT) {
+		WRITE_ONCE(dma_timeouts, dma_timeouts + 1);
+	}
 	else {
-		cnt = 0;
+		WRITE_ONCE(dma_errors, dma_errors + 1);
+	}
+	if(dma_init0(dma0_p) || dma_init1(dma1_p) || dma_init2(dma2_p)) {
+		ret = -EIO;
+	}
+	/*
+	 * A completion racing with the reset must not end the next transfer.
+	 * An emulated channel completes from its timer, which may already be
+	 * past the reset's try-cancel, so wait for it to finish instead.
+	 */
+	for(int i = 0; i < 3; i++) {
+		if(devs[i]->emu) {
+			fpm_emu_sync(devs[i]->emu);
+		}
+		else {
+			synchronize_irq(devs[i]->irq_num);
+		}
 	}
-	printk(KERN_INFO "[dma_simple_read] Successfully read from DMA2 \n");
+	transaction_over0 = 0;
+	transaction_over1 = 0;
+	transaction_over2 = 0;
+	if(ret) {
+		printk(KERN_ERR "[fpm_dma_recover] DMA channels did not come back after %s\n", err == -ETIMEDOUT ? "a timeout" : "an error");
+		return ret;
+	}
+	printk(KERN_WARNING "[fpm_dma_recover] Reset DMA channels after %s\n", err == -ETIMEDOUT ? "a timeout" : "an error");
 	return 0;
 }
 
+/* One multiplication: operand a through DMA0, operand b through DMA1, product back through DMA2 */
+static int fpm_mul_pair(dma_addr_t a_phy, dma_addr_t b_phy, dma_addr_t res_phy) {
+	int ret;
+	for(unsigned int try = 0; ; try++) {
+		ret = dma_simple_write1(a_phy, MAX_PKT_LEN, dma0_p);
+		if(!ret) {
+			ret = dma_simple_write2(b_phy, MAX_PKT_LEN, dma1_p);
+		}
+		if(!ret) {
+			ret = dma_simple_read(res_phy, MAX_PKT_LEN, dma2_p);
+		}
+		if(!ret) {
+			return 0;
+		}
+		if(fpm_dma_recover(ret)) {
+			return -EIO;
+		}
+		if(try >= READ_ONCE(dma_retries)) {
+			return ret;
+		}
+	}
+}
+
+/* Multiplies one pair through the shared TX buffer, called while owning the FPM */
+static int fpm_mul_tx(u32 a, u32 b, u32 *res) {
+	int ret;
+	for(unsigned int try = 0; ; try++) {
+		*tx_vir_buffer = a;
+		ret = dma_simple_write1(tx_phy_buffer, MAX_PKT_LEN, dma0_p);
+		if(!ret) {
+			*tx_vir_buffer = b;
+			ret = dma_simple_write2(tx_phy_buffer, MAX_PKT_LEN, dma1_p);
+		}
+		if(!ret) {
+			ret = dma_simple_read(tx_phy_buffer, MAX_PKT_LEN, dma2_p);
+		}
+		if(!ret) {
+			*res = *tx_vir_buffer;
+			return 0;
+		}
+		if(fpm_dma_recover(ret)) {
+			return -EIO;
+		}
+		if(try >= READ_ONCE(dma_retries)) {
+			return ret;
+		}
+	}
+}
+
 /* -------------------------------------- */
 /* ------INTERRUPT SERVICE ROUTINES------ */
 /* -------------------------------------- */
 
+/* Logs what an error interrupt reports, the channel halts until it is reset */
+static void fpm_dma_decode_err(const char *isr, u32 status) {
+	printk(KERN_ERR "[%s] DMA error, status %#x:%s%s%s\n", isr, status,
+	       status & DMASR_DMA_INT_ERR ? " internal" : "",
+	       status & DMASR_DMA_SLV_ERR ? " slave" : "",
+	       status & DMASR_DMA_DEC_ERR ? " decode" : "");
+}
+
 static irqreturn_t dma0_MM2S_isr(int irq, void* dev_id) {
 	unsigned int IrqStatus;  
-	IrqStatus = ioread32(dma0_p->base_addr + MM2S_STATUS_REG);
-	iowrite32(IrqStatus | 0x00007000, dma0_p->base_addr + MM2S_STATUS_REG);
-	printk(KERN_INFO "[dma0_isr] Finished DMA0 MM2S transaction!\n");
-	transaction_over0 = 0;
+	IrqStatus = fpm_ioread32(dma0_p, MM2S_STATUS_REG);
+	fpm_iowrite32(dma0_p, IrqStatus | 0x00007000, MM2S_STATUS_REG);
+	if(IrqStatus & DMASR_ERR_IRQ) {
+		fpm_dma_decode_err("dma0_isr", IrqStatus);
+		smp_store_release(&transaction_err0, IrqStatus);
+	}
+	else {
+		pr_debug("[dma0_isr] Finished DMA0 MM2S transaction!\n");
+	}
+	smp_store_release(&transaction_over0, 0);
 	return IRQ_HANDLED;
 }
 static irqreturn_t dma1_MM2S_isr(int irq, void* dev_id) {
 	unsigned int IrqStatus;  
-	IrqStatus = ioread32(dma1_p->base_addr + MM2S_STATUS_REG);
-	iowrite32(IrqStatus | 0x00007000, dma1_p->base_addr + MM2S_STATUS_REG);
-	printk(KERN_INFO "[dma1_isr] Finished DMA1 MM2S transaction!\n");
-	transaction_over1 = 0;
+	IrqStatus = fpm_ioread32(dma1_p, MM2S_STATUS_REG);
+	fpm_iowrite32(dma1_p, IrqStatus | 0x00007000, MM2S_STATUS_REG);
+	if(IrqStatus & DMASR_ERR_IRQ) {
+		fpm_dma_decode_err("dma1_isr", IrqStatus);
+		smp_store_release(&transaction_err1, IrqStatus);
+	}
+	else {
+		pr_debug("[dma1_isr] Finished DMA1 MM2S transaction!\n");
+	}
+	smp_store_release(&transaction_over1, 0);
 	return IRQ_HANDLED;
 }
 static irqreturn_t dma2_S2MM_isr(int irq, void* dev_id){
 	unsigned int IrqStatus;  
-	IrqStatus = ioread32(dma2_p->base_addr + S2MM_STATUS_REG);
-	iowrite32(IrqStatus | 0x00007000, dma2_p->base_addr + S2MM_STATUS_REG);
-	printk(KERN_INFO "[dma2_isr] Finished DMA2 S2MM transaction!\n");
-	izlazni_niz[pos_out] = *tx_vir_buffer;
-	printk(KERN_INFO "[fpm_write] RESULT %d: %#x\n", (pos_out + 1), izlazni_niz[pos_out]);
-	pos_out++;
-	transaction_over2 = 0;
+	IrqStatus = fpm_ioread32(dma2_p, S2MM_STATUS_REG);
+	fpm_iowrite32(dma2_p, IrqStatus | 0x00007000, S2MM_STATUS_REG);
+	if(IrqStatus & DMASR_ERR_IRQ) {
+		fpm_dma_decode_err("dma2_isr", IrqStatus);
+		smp_store_release(&transaction_err2, IrqStatus);
+	}
+	else {
+		pr_debug("[dma2_isr] Finished DMA2 S2MM transaction!\n");
+	}
+	smp_store_release(&transaction_over2, 0);
 	return IRQ_HANDLED;
 }
 
+/* -------------------------------------- */
+/* -------EMULATED FPM AND AXI DMA------- */
+/* -------------------------------------- */
+
+/*
+ * With emulate=1 the driver binds to three platform devices registered by
+ * itself. Each one models the register file of an AXI DMA in simple mode
+ * and the FPM computes the products in software. A transfer completes
+ * after emu_setup_ns + beats * emu_beat_ns (+ bytes / emu_bw_mbps) and
+ * raises IOC through an hrtimer that calls the regular ISR.
+ * emu_fault_every and emu_hang_every inject failed and lost transfers to
+ * exercise the error recovery.
+ */
+
+struct fpm_emu_chan {
+	spinlock_t lock;
+	u32 regs[EMU_REG_SPACE / 4];
+	int port;		/* 0, 1: FPM operand inputs (MM2S), 2: FPM result (S2MM) */
+	bool busy;
+	u32 error;		/* DMASR error bits the running transfer ends with */
+	u32 s2mm_pending;	/* beats of an S2MM transfer waiting for operands */
+	struct hrtimer timer;
+	irq_handler_t isr;
+	void *dev_id;
+};
+
+/* The FPM core, operands queue per input until both are present */
+struct fpm_emu_core {
+	spinlock_t lock;
+	u32 fifo[2][EMU_FIFO_DEPTH];
+	unsigned int head[2];
+	unsigned int count[2];
+	atomic_t transfers;	/* counts transfers for emu_fault_every and emu_hang_every */
+};
+
+static struct fpm_emu_core fpm_emu = {
+	.lock = __SPIN_LOCK_UNLOCKED(fpm_emu.lock),
+};
+static struct fpm_emu_chan *emu_chan[3];
+static struct platform_device *emu_pdev[3];
+
+/* IEEE-754 single precision product, round to nearest even */
+static u32 fpm_emu_fmul(u32 a, u32 b) {
+	u32 sign = (a ^ b) & 0x80000000;
+	int ea = (a >> 23) & 0xff;
+	int eb = (b >> 23) & 0xff;
+	u32 ma = a & 0x7fffff;
+	u32 mb = b & 0x7fffff;
+	u64 m;
+	u64 rem;
+	u64 half;
+	u32 mant;
+	int e;
+	int s;
+
+	/* NaN, infinity and zero operands */
+	if((ea == 0xff && ma) || (eb == 0xff && mb)) {
+		return 0x7fc00000;
+	}
+	if(ea == 0xff || eb == 0xff) {
+		if((ea == 0 && !ma) || (eb == 0 && !mb)) {
+			return 0x7fc00000;
+		}
+		return sign | 0x7f800000;
+	}
+	if((ea == 0 && !ma) || (eb == 0 && !mb)) {
+		return sign;
+	}
+	/* Normalize subnormal operands */
+	if(ea == 0) {
+		while(!(ma & 0x800000)) {
+			ma <<= 1;
+			ea--;
+		}
+		ea++;
+	}
+	else {
+		ma |= 0x800000;
+	}
+	if(eb == 0) {
+		while(!(mb & 0x800000)) {
+			mb <<= 1;
+			eb--;
+		}
+		eb++;
+	}
+	else {
+		mb |= 0x800000;
+	}
+
+	m = (u64)ma * mb;
+	e = ea + eb - 126;
+	if(!(m & (1ULL << 47))) {
+		m <<= 1;
+		e--;
+	}
+	if(e >= 0xff) {
+		return sign | 0x7f800000;
+	}
+	/* 24 bits of mantissa remain, fewer for subnormal results */
+	s = e > 0 ? 24 : 25 - e;
+	if(s > 49) {
+		return sign;
+	}
+	mant = m >> s;
+	rem = m & ((1ULL << s) - 1);
+	half = 1ULL << (s - 1);
+	if(rem > half || (rem == half && (mant & 1))) {
+		mant++;
+	}
+	if(e <= 0) {
+		return sign | mant;
+	}
+	if(mant == 0x1000000) {
+		mant >>= 1;
+		e++;
+		if(e >= 0xff) {
+			return sign | 0x7f800000;
+		}
+	}
+	return sign | ((u32)e << 23) | (mant & 0x7fffff);
+}
+
+/* Emulated devices use dma-direct without an IOMMU, bus addresses are physical */
+static u32 *fpm_emu_virt(u32 addr) {
+	return phys_to_virt((phys_addr_t)addr);
+}
+
+static u64 fpm_emu_latency(u32 bytes) {
+	u64 ns = emu_setup_ns + (u64)(bytes / 4) * emu_beat_ns;
+	if(emu_bw_mbps) {
+		ns += div_u64((u64)bytes * 1000, emu_bw_mbps);
+	}
+	return ns;
+}
+
+/* Called with ch->lock held */
+static void fpm_emu_complete_after(struct fpm_emu_chan *ch, u32 bytes) {
+	ch->busy = true;
+	hrtimer_start(&ch->timer, ns_to_ktime(fpm_emu_latency(bytes)), HRTIMER_MODE_REL_HARD);
+}
+
+/* Starts an injected faulty transfer instead of a real one, called with ch->lock held */
+static bool fpm_emu_inject(struct fpm_emu_chan *ch, u32 len) {
+	unsigned int fault = READ_ONCE(emu_fault_every);
+	unsigned int hang = READ_ONCE(emu_hang_every);
+	int n;
+	if(!fault && !hang) {
+		return false;
+	}
+	n = atomic_inc_return(&fpm_emu.transfers);
+	if(hang && n % hang == 0) {
+		/* Busy without a timer, the transfer never completes */
+		ch->busy = true;
+		return true;
+	}
+	if(fault && n % fault == 0) {
+		ch->error = DMASR_DMA_SLV_ERR;
+		fpm_emu_complete_after(ch, len);
+		return true;
+	}
+	return false;
+}
+
+/* Streams operands of an MM2S transfer into the FPM, called with ch->lock held */
+static void fpm_emu_mm2s(struct fpm_emu_chan *ch, u32 len) {
+	u32 *src = fpm_emu_virt(ch->regs[MM2S_SA_REG / 4]);
+	int port = ch->port;
+	unsigned int tail;
+	spin_lock(&fpm_emu.lock);
+	for(u32 i = 0; i < len / 4 && fpm_emu.count[port] < EMU_FIFO_DEPTH; i++) {
+		tail = (fpm_emu.head[port] + fpm_emu.count[port]) % EMU_FIFO_DEPTH;
+		fpm_emu.fifo[port][tail] = src[i];
+		fpm_emu.count[port]++;
+	}
+	spin_unlock(&fpm_emu.lock);
+	fpm_emu_complete_after(ch, len);
+}
+
+/* Writes products once both operand queues hold enough beats, called with ch->lock held */
+static void fpm_emu_s2mm(struct fpm_emu_chan *ch) {
+	u32 *dst;
+	u32 a, b;
+	u32 beats = ch->s2mm_pending;
+	if(!beats) {
+		return;
+	}
+	spin_lock(&fpm_emu.lock);
+	if(fpm_emu.count[0] < beats || fpm_emu.count[1] < beats) {
+		spin_unlock(&fpm_emu.lock);
+		return;
+	}
+	dst = fpm_emu_virt(ch->regs[S2MM_DA_REG / 4]);
+	for(u32 i = 0; i < beats; i++) {
+		a = fpm_emu.fifo[0][fpm_emu.head[0]];
+		b = fpm_emu.fifo[1][fpm_emu.head[1]];
+		fpm_emu.head[0] = (fpm_emu.head[0] + 1) % EMU_FIFO_DEPTH;
+		fpm_emu.head[1] = (fpm_emu.head[1] + 1) % EMU_FIFO_DEPTH;
+		fpm_emu.count[0]--;
+		fpm_emu.count[1]--;
+		dst[i] = fpm_emu_fmul(a, b);
+	}
+	spin_unlock(&fpm_emu.lock);
+	ch->s2mm_pending = 0;
+	fpm_emu_complete_after(ch, beats * 4);
+}
+
+/* New operands may unblock a waiting S2MM transfer */
+static void fpm_emu_kick_s2mm(void) {
+	struct fpm_emu_chan *ch = emu_chan[2];
+	unsigned long flags;
+	if(!ch) {
+		return;
+	}
+	spin_lock_irqsave(&ch->lock, flags);
+	fpm_emu_s2mm(ch);
+	spin_unlock_irqrestore(&ch->lock, flags);
+}
+
+static enum hrtimer_restart fpm_emu_timer(struct hrtimer *timer) {
+	struct fpm_emu_chan *ch = container_of(timer, struct fpm_emu_chan, timer);
+	u32 cr = ch->port == 2 ? S2MM_DMACR_REG : MM2S_DMACR_REG;
+	bool irq;
+	spin_lock(&ch->lock);
+	if(!ch->busy) {
+		/* Channel was reset while the transfer was in flight */
+		spin_unlock(&ch->lock);
+		return HRTIMER_NORESTART;
+	}
+	ch->busy = false;
+	if(ch->error) {
+		/* A failed transfer halts the channel until it is reset */
+		ch->regs[(cr + 4) / 4] |= DMASR_HALTED | ch->error | DMASR_ERR_IRQ;
+		ch->regs[cr / 4] &= ~DMACR_RUN_STOP;
+		ch->error = 0;
+		irq = ch->regs[cr / 4] & ERR_IRQ_EN;
+	}
+	else {
+		ch->regs[(cr + 4) / 4] |= DMASR_IDLE | DMASR_IOC_IRQ;
+		irq = ch->regs[cr / 4] & IOC_IRQ_EN;
+	}
+	spin_unlock(&ch->lock);
+	if(irq) {
+		ch->isr(ch->port, ch->dev_id);
+	}
+	return HRTIMER_NORESTART;
+}
+
+/* Called with ch->lock held */
+/* Waits for a completion in flight, the counterpart of synchronize_irq for a real channel */
+static void fpm_emu_sync(struct fpm_emu_chan *ch) {
+	hrtimer_cancel(&ch->timer);
+}
+
+static void fpm_emu_reset(struct fpm_emu_chan *ch) {
+	memset(ch->regs, 0, sizeof(ch->regs));
+	ch->regs[MM2S_STATUS_REG / 4] = DMASR_HALTED;
+	ch->regs[S2MM_STATUS_REG / 4] = DMASR_HALTED;
+	ch->busy = false;
+	ch->error = 0;
+	ch->s2mm_pending = 0;
+	hrtimer_try_to_cancel(&ch->timer);
+	if(ch->port < 2) {
+		/* Operands the channel already streamed into the FPM are dropped */
+		spin_lock(&fpm_emu.lock);
+		fpm_emu.head[ch->port] = 0;
+		fpm_emu.count[ch->port] = 0;
+		spin_unlock(&fpm_emu.lock);
+	}
+}
+
+static u32 fpm_emu_read(struct fpm_emu_chan *ch, u32 reg) {
+	unsigned long flags;
+	u32 val;
+	if(reg >= EMU_REG_SPACE) {
+		return 0;
+	}
+	spin_lock_irqsave(&ch->lock, flags);
+	val = ch->regs[reg / 4];
+	spin_unlock_irqrestore(&ch->lock, flags);
+	return val;
+}
+
+static void fpm_emu_write(struct fpm_emu_chan *ch, u32 reg, u32 val) {
+	u32 cr = reg >= S2MM_DMACR_REG ? S2MM_DMACR_REG : MM2S_DMACR_REG;
+	u32 sr = cr + 4;
+	unsigned long flags;
+	bool kick = false;
+	if(reg >= EMU_REG_SPACE) {
+		return;
+	}
+	spin_lock_irqsave(&ch->lock, flags);
+	switch(reg) {
+		case MM2S_DMACR_REG:
+		case S2MM_DMACR_REG:
+			if(val & DMACR_RESET) {
+				/* Reset completes at once and clears the whole register file */
+				fpm_emu_reset(ch);
+				break;
+			}
+			ch->regs[cr / 4] = val;
+			if(val & DMACR_RUN_STOP) {
+				ch->regs[sr / 4] &= ~DMASR_HALTED;
+			}
+			else {
+				ch->regs[sr / 4] |= DMASR_HALTED;
+			}
+			break;
+		case MM2S_STATUS_REG:
+		case S2MM_STATUS_REG:
+			/* Interrupt bits are write one to clear */
+			ch->regs[sr / 4] &= ~(val & DMASR_IRQ_MASK);
+			break;
+		case MM2S_LENGTH_REG:
+		case S2MM_LENGTH_REG:
+			ch->regs[reg / 4] = val;
+			if(!(ch->regs[cr / 4] & DMACR_RUN_STOP) || val < 4) {
+				break;
+			}
+			ch->regs[sr / 4] &= ~DMASR_IDLE;
+			if(fpm_emu_inject(ch, val)) {
+				break;
+			}
+			if(cr == MM2S_DMACR_REG) {
+				fpm_emu_mm2s(ch, val);
+				kick = true;
+			}
+			else {
+				ch->s2mm_pending = val / 4;
+				fpm_emu_s2mm(ch);
+			}
+			break;
+		default:
+			ch->regs[reg / 4] = val;
+			break;
+	}
+	spin_unlock_irqrestore(&ch->lock, flags);
+	if(kick) {
+		fpm_emu_kick_s2mm();
+	}
+}
+
+static int fpm_emu_probe(struct platform_device *pdev) {
+	static const irq_handler_t isrs[] = { dma0_MM2S_isr, dma1_MM2S_isr, dma2_S2MM_isr };
+	struct fpm_info **slots[] = { &dma0_p, &dma1_p, &dma2_p };
+	struct fpm_info *info;
+	struct fpm_emu_chan *ch;
+	int port = pdev->id;
+
+	if(strcmp(pdev->name, DRIVER_NAME) || port < 0 || port > 2 || emu_chan[port]) {
+		printk(KERN_NOTICE "[fpm_emu_probe] Devices weren't be detected\n");
+		return -ENODEV;
+	}
+	if(*slots[port]) {
+		/* A real DMA from the device tree already serves this port */
+		printk(KERN_NOTICE "[fpm_emu_probe] dma%d is already bound, not emulating it\n", port);
+		return -EBUSY;
+	}
+	info = kzalloc(sizeof(struct fpm_info), GFP_KERNEL);
+	ch = kzalloc(sizeof(struct fpm_emu_chan), GFP_KERNEL);
+	if(!info || !ch) {
+		printk(KERN_ALERT "[fpm_emu_probe] Could not allocate emulated dma%d\n", port);
+		kfree(info);
+		kfree(ch);
+		return -ENOMEM;
+	}
+	spin_lock_init(&ch->lock);
+	ch->port = port;
+	ch->isr = isrs[port];
+	ch->dev_id = info;
+	ch->regs[MM2S_STATUS_REG / 4] = DMASR_HALTED;
+	ch->regs[S2MM_STATUS_REG / 4] = DMASR_HALTED;
+	hrtimer_init(&ch->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+	ch->timer.function = fpm_emu_timer;
+	info->irq_num = port;
+	info->emu = ch;
+	emu_chan[port] = ch;
+
+	switch(port) {
+		case 0:
+			dma0_p = info;
+			dma_init0(dma0_p);
+			break;
+		case 1:
+			dma1_p = info;
+			dma_init1(dma1_p);
+			break;
+		case 2:
+			dma2_p = info;
+			dma_init2(dma2_p);
+			break;
+	}
+	printk(KERN_NOTICE "[fpm_emu_probe] fpm platform driver registered - emulated dma%d\n", port);
+	return 0;
+}
+
+static int fpm_emu_remove(struct platform_device *pdev) {
+	struct fpm_info **slots[] = { &dma0_p, &dma1_p, &dma2_p };
+	struct fpm_info **info;
+	int port = pdev->id;
+	if(port < 0 || port > 2 || !emu_chan[port]) {
+		return 0;
+	}
+	info = slots[port];
+	emu_chan[port] = NULL;
+	hrtimer_cancel(&(*info)->emu->timer);
+	kfree((*info)->emu);
+	kfree(*info);
+	*info = NULL;
+	printk(KERN_INFO "[fpm_emu_remove] Succesfully removed emulated dma%d\n", port);
+	return 0;
+}
+
+static int fpm_emu_register(void) {
+	for(int i = 0; i < 3; i++) {
+		emu_pdev[i] = platform_device_register_simple(DRIVER_NAME, i, NULL, 0);
+		if(IS_ERR(emu_pdev[i])) {
+			printk(KERN_ALERT "[fpm_emu_register] Could not register emulated dma%d\n", i);
+			emu_pdev[i] = NULL;
+			fpm_emu_unregister();
+			return -ENODEV;
+		}
+	}
+	return 0;
+}
+
+static void fpm_emu_unregister(void) {
+	for(int i = 2; i >= 0; i--) {
+		if(emu_pdev[i]) {
+			platform_device_unregister(emu_pdev[i]);
+			emu_pdev[i] = NULL;
+		}
+	}
+}
@@ -0,0 +1,102 @@
+/* Userspace interface of the /dev/fpmult driver */
+
+#ifndef FPMULT_H
+#define FPMULT_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* -------------------------------------- */
+/* -----------STAGING AREA LAYOUT-------- */
+/* -------------------------------------- */
+
+/*
+ * Every open file has its own DMA staging area. It is mapped with
+ * mmap(offset = FPM_STAGING_PGOFF * page size) and holds operand pairs
+ * (a0, b0, a1, b1, ...) followed by the results (r0, r1, ...).
+ */
+#define FPM_STAGING_PAIRS	4096
+#define FPM_STAGING_OPS_OFF	0
+#define FPM_STAGING_RES_OFF	(FPM_STAGING_PAIRS * 2 * sizeof(__u32))
+#define FPM_STAGING_SIZE	(FPM_STAGING_RES_OFF + FPM_STAGING_PAIRS * sizeof(__u32))
+#define FPM_STAGING_PGOFF	1
+
+/*
+ * The wire format of read/write, readv/writev, splice and sendfile is set
+ * per open file with FPM_IOC_SET_MODE. FPM_MODE_TEXT (the default) speaks
+ * the "0x.., 0x..;" text protocol. FPM_MODE_STREAM streams raw operand
+ * pairs into the staging area and raw results out of it. At most
+ * FPM_STAGING_PAIRS pairs can be pending, further writes block until the
+ * results are read. Reads block until a result is ready. On a non-blocking
+ * file both fail with EAGAIN instead and poll reports when to retry.
+ *
+ * The writer ends a stream with FPM_IOC_STREAM_END. A trailing partial pair
+ * is dropped, reads return 0 once every result has been read and writes
+ * fail with EPIPE. FPM_IOC_SET_MODE starts a new stream.
+ */
+#define FPM_MODE_TEXT		0
+#define FPM_MODE_STREAM		1
+
+/* -------------------------------------- */
+/* ----------------IOCTLS---------------- */
+/* -------------------------------------- */
+
+/* fpm_batch.flags: operands and results live in the mmap'ed staging area */
+#define FPM_BATCH_STAGING	(1 << 0)
+
+struct fpm_batch {
+	__u32 count;	/* number of operand pairs */
+	__u32 flags;
+	__u64 ops;	/* user pointer to count pairs of IEEE-754 floats */
+	__u64 res;	/* user pointer to count results */
+};
+
+/*
+ * Priority classes of an open file. Batches are split into bursts of
+ * burst_pairs (sysfs) and a waiting higher class gets the FPM at the next
+ * burst boundary. FPM_PRIO_HIGH needs CAP_SYS_NICE.
+ */
+#define FPM_BURST_PAIRS		64	/* default of burst_pairs */
+#define FPM_PRIO_HIGH		0
+#define FPM_PRIO_NORMAL		1
+#define FPM_PRIO_BULK		2
+#define FPM_PRIO_LEVELS		3
+
+/* -------------------------------------- */
+/* ------------REQUEST TRACE------------- */
+/* -------------------------------------- */
+
+/*
+ * While debugfs fpmult/trace_enable is 1 every submission is recorded and
+ * fpmult/trace reads the records back as a byte stream. Each record is a
+ * struct fpm_trace_rec followed by count operand pairs. A batch larger
+ * than the staging area is recorded as one record per staging chunk, the
+ * later ones flagged FPM_TRACE_CONT.
+ */
+#define FPM_TRACE_TEXT		0	/* write(2) text protocol */
+#define FPM_TRACE_IOCTL		1	/* FPM_IOC_MUL with user pointers */
+#define FPM_TRACE_STAGING	2	/* FPM_IOC_MUL with FPM_BATCH_STAGING */
+#define FPM_TRACE_STREAM	3	/* write_iter, splice, sendfile */
+
+#define FPM_TRACE_CONT		(1 << 0)
+
+struct fpm_trace_rec {
+	__u64 ts_ns;	/* CLOCK_MONOTONIC time the record was stored */
+	__u32 client;	/* id of the open file */
+	__u32 count;	/* operand pairs following the record */
+	__u8  method;	/* FPM_TRACE_* */
+	__u8  prio;	/* FPM_PRIO_* of the file at submission */
+	__u8  flags;
+	__u8  pad;
+	__u32 lost;	/* records dropped before this one, the buffer was full */
+};
+
+#define FPM_IOC_MAGIC		'f'
+#define FPM_IOC_MUL		_IOW(FPM_IOC_MAGIC, 1, struct fpm_batch)
+#define FPM_IOC_SET_PRIO	_IOW(FPM_IOC_MAGIC, 2, __u32)
+#define FPM_IOC_GET_PRIO	_IOR(FPM_IOC_MAGIC, 3, __u32)
+#define FPM_IOC_SET_MODE	_IOW(FPM_IOC_MAGIC, 4, __u32)
+#define FPM_IOC_GET_MODE	_IOR(FPM_IOC_MAGIC, 5, __u32)
+#define FPM_IOC_STREAM_END	_IO(FPM_IOC_MAGIC, 6)
+
+#endif /* FPMULT_H */